@@ -0,0 +1,876 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "animation.h"
+#include "log.h"
+
+#if HAVE_GDK_PIXBUF
+#include <fcntl.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <pixman.h>
+#include <pthread.h>
+#include "image.h"
+#include "shm.h"
+
+// Frames drawn ahead of the compositor, which may still read older ones
+#define ANIMATION_BUFFERS 3
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define FRAME_FORMAT PIXMAN_x8r8g8b8
+#define PIXBUF_FORMAT PIXMAN_x8b8g8r8
+#else
+#define FRAME_FORMAT PIXMAN_b8g8r8x8
+#define PIXBUF_FORMAT PIXMAN_r8g8b8x8
+#endif
+
+// The animation parsed from an image by the loader thread
+struct animated_image {
+	struct wsbg_image *image;  // NULL once forgotten while loading
+	char *path;
+	bool loaded;
+	GdkPixbufAnimation *pixbuf_animation;  // NULL if not animated
+	struct wl_list link;
+};
+
+struct frame_buffer {
+	struct animation *animation;  // NULL once the animation stopped
+	struct wsbg_animator *animator;
+	struct wl_buffer *buffer;
+	struct wsbg_shm_block *block;
+	bool busy;  // until the compositor releases it
+	struct wl_list link;
+};
+
+struct animation {
+	struct wsbg_animator *animator;
+	struct wsbg_output *output;
+	struct wsbg_image *image;
+	// Size of the buffers of the output, to place frames once loaded
+	int32_t buffer_width, buffer_height;
+	GdkPixbufAnimation *pixbuf_animation;  // NULL while loading
+	GdkPixbufAnimationIter *iter;
+	GdkPixbuf *composited;  // current frame over the background color
+	int32_t width, height;
+	// Frames are shown on the image subsurface of letterboxed configs
+	struct wl_surface *surface;
+	struct wsbg_source source;
+	struct wsbg_box box;
+	struct wl_list buffers;  // struct frame_buffer::link
+	struct wl_callback *frame_callback;  // NULL once a frame can be drawn
+	bool starved;  // all buffers are in use
+	bool covered;  // by a still buffer, so the frame is drawn again
+	int64_t deadline;  // of the next frame in CLOCK_MONOTONIC ms, or -1
+	struct wl_list link;
+};
+
+struct wsbg_animator {
+	struct wsbg_state *state;
+	struct wsbg_shm *pools;  // only used by the main thread
+	int timer;
+	struct wl_list animations;  // struct animation::link
+	struct wl_list retired;  // struct frame_buffer::link, of stopped ones
+
+	// Images are parsed on a thread of their own, which signals `fd`
+	pthread_t thread;
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list images;  // struct animated_image::link
+	struct animated_image *loading;
+	bool exit;
+};
+
+static int64_t get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Returns whether the PNG file `fd` has an animation control chunk, which
+ * comes before its image data.
+ */
+static bool is_apng(int fd) {
+	off_t offset = 8;  // past the signature
+	unsigned char chunk[8];
+	while (pread(fd, chunk, sizeof chunk, offset) == sizeof chunk) {
+		if (memcmp(chunk + 4, "acTL", 4) == 0) {
+			return true;
+		} else if (memcmp(chunk + 4, "IDAT", 4) == 0) {
+			break;
+		}
+		uint32_t length = (uint32_t)chunk[0] << 24 | chunk[1] << 16 |
+			chunk[2] << 8 | chunk[3];
+		offset += (off_t)length + 12;
+	}
+	return false;
+}
+
+/**
+ * Returns whether the file at `path` is of a format gdk-pixbuf animates.
+ * Opening other images as animations would decode them once more.
+ */
+static bool may_be_animated(const char *path) {
+	unsigned char magic[12] = {0};
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	bool animated = false;
+	if (read(fd, magic, sizeof magic) != sizeof magic) {
+		goto out;
+	}
+	animated = memcmp(magic, "GIF8", 4) == 0 ||
+		(memcmp(magic, "RIFF", 4) == 0 && memcmp(magic + 8, "WEBP", 4) == 0);
+	// gdk-pixbuf only decodes the default image of animated PNGs
+	if (memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0 && is_apng(fd)) {
+		wsbg_log(LOG_DEBUG, "Showing animated PNG %s as a still image", path);
+	}
+
+out:
+	close(fd);
+	return animated;
+}
+
+/**
+ * Parses the image at `path`. Returns NULL if it isn't animated.
+ */
+static GdkPixbufAnimation *load_animation(const char *path) {
+	if (!may_be_animated(path)) {
+		return NULL;
+	}
+	GError *err = NULL;
+	GdkPixbufAnimation *pixbuf_animation =
+		gdk_pixbuf_animation_new_from_file(path, &err);
+	if (!pixbuf_animation) {
+		wsbg_log(LOG_DEBUG, "Failed to load animation %s: %s",
+				path, err->message);
+		g_error_free(err);
+		return NULL;
+	}
+	if (gdk_pixbuf_animation_is_static_image(pixbuf_animation)) {
+		g_object_unref(pixbuf_animation);
+		return NULL;
+	}
+	return pixbuf_animation;
+}
+
+static void destroy_animated_image(struct animated_image *image) {
+	if (image->pixbuf_animation) {
+		g_object_unref(image->pixbuf_animation);
+	}
+	free(image->path);
+	free(image);
+}
+
+static void *load_main(void *data) {
+	struct wsbg_animator *animator = data;
+	pthread_mutex_lock(&animator->lock);
+	while (!animator->exit) {
+		struct animated_image *image, *next = NULL;
+		wl_list_for_each(image, &animator->images, link) {
+			if (!image->loaded) {
+				next = image;
+				break;
+			}
+		}
+		if (!next) {
+			pthread_cond_wait(&animator->cond, &animator->lock);
+			continue;
+		}
+		animator->loading = next;
+		pthread_mutex_unlock(&animator->lock);
+
+		GdkPixbufAnimation *pixbuf_animation = load_animation(next->path);
+
+		pthread_mutex_lock(&animator->lock);
+		animator->loading = NULL;
+		next->pixbuf_animation = pixbuf_animation;
+		next->loaded = true;
+		if (!next->image) {
+			destroy_animated_image(next);
+		} else if (eventfd_write(animator->fd, 1) == -1) {
+			wsbg_log_errno(LOG_ERROR, "Unable to signal loaded animation");
+		}
+	}
+	pthread_mutex_unlock(&animator->lock);
+	return NULL;
+}
+
+static void destroy_frame_buffer(struct frame_buffer *buffer) {
+	wl_list_remove(&buffer->link);
+	wl_buffer_destroy(buffer->buffer);
+	wsbg_shm_free(buffer->block);
+	free(buffer);
+}
+
+/**
+ * Sets the timer to expire when the earliest frame is due, among the
+ * animations waiting for nothing else. Frames already due expire it at
+ * once.
+ */
+static void arm_timer(struct wsbg_animator *animator) {
+	int64_t deadline = -1;
+	struct animation *animation;
+	wl_list_for_each(animation, &animator->animations, link) {
+		int64_t due = animation->covered ? 0 : animation->deadline;
+		if (!animation->frame_callback && !animation->starved &&
+				due != -1 && (deadline == -1 || due < deadline)) {
+			deadline = due;
+		}
+	}
+	struct itimerspec spec = {0};
+	if (deadline != -1) {
+		// A zero value would disarm the timer instead
+		spec.it_value.tv_sec = deadline / 1000;
+		spec.it_value.tv_nsec = deadline % 1000 * 1000000 + 1;
+	}
+	if (timerfd_settime(animator->timer, TFD_TIMER_ABSTIME,
+			&spec, NULL) == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to set animation timer");
+	}
+}
+
+static void show_frame(struct animation *animation);
+
+static void frame_buffer_release(void *data, struct wl_buffer *wl_buffer) {
+	struct frame_buffer *buffer = data;
+	buffer->busy = false;
+	if (!buffer->animation) {
+		destroy_frame_buffer(buffer);
+		return;
+	}
+	// A frame may have waited for a buffer
+	if (buffer->animation->starved) {
+		buffer->animation->starved = false;
+		show_frame(buffer->animation);
+		arm_timer(buffer->animator);
+	}
+}
+
+static const struct wl_buffer_listener frame_buffer_listener = {
+	.release = frame_buffer_release,
+};
+
+static void frame_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct animation *animation = data;
+	wl_callback_destroy(callback);
+	animation->frame_callback = NULL;
+	show_frame(animation);
+	arm_timer(animation->animator);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+/**
+ * Returns a buffer the compositor doesn't use, or NULL if all of them are
+ * in use.
+ */
+static struct frame_buffer *get_frame_buffer(struct animation *animation) {
+	size_t count = 0;
+	struct frame_buffer *buffer;
+	wl_list_for_each(buffer, &animation->buffers, link) {
+		if (!buffer->busy) {
+			return buffer;
+		}
+		++count;
+	}
+	if (count >= ANIMATION_BUFFERS) {
+		return NULL;
+	}
+
+	if (!(buffer = calloc(1, sizeof *buffer))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	buffer->animation = animation;
+	buffer->animator = animation->animator;
+	buffer->block = wsbg_shm_alloc(animation->animator->pools,
+			animation->width, animation->height, animation->width * 4,
+			WL_SHM_FORMAT_XRGB8888, &buffer->buffer);
+	if (!buffer->block) {
+		free(buffer);
+		return NULL;
+	}
+	wl_buffer_add_listener(buffer->buffer, &frame_buffer_listener, buffer);
+	wl_list_insert(animation->buffers.prev, &buffer->link);
+	return buffer;
+}
+
+/**
+ * Draws the current frame into `buffer`, over the background color.
+ */
+static bool draw_frame(struct animation *animation,
+		struct frame_buffer *buffer) {
+	struct wsbg_color color = animation->output->config->color;
+	guint32 background = UINT32_C(0xFF000000) +
+		UINT32_C(0x00010000) * color.r +
+		UINT32_C(0x00000100) * color.g +
+		UINT32_C(0x00000001) * color.b;
+	GdkPixbuf *frame = gdk_pixbuf_animation_iter_get_pixbuf(animation->iter);
+	if (!frame || gdk_pixbuf_get_width(frame) != animation->width ||
+			gdk_pixbuf_get_height(frame) != animation->height) {
+		return false;
+	}
+	gdk_pixbuf_composite_color(frame, animation->composited,
+			0, 0, animation->width, animation->height, 0, 0, 1, 1,
+			GDK_INTERP_NEAREST, 0xFF, 0, 0, 8, background, background);
+
+	pixman_image_t *source = pixman_image_create_bits_no_clear(
+			PIXBUF_FORMAT, animation->width, animation->height,
+			(void *)gdk_pixbuf_get_pixels(animation->composited),
+			gdk_pixbuf_get_rowstride(animation->composited));
+	// Allocating another buffer may have moved the data of this one
+	pixman_image_t *dest = pixman_image_create_bits_no_clear(
+			FRAME_FORMAT, animation->width, animation->height,
+			wsbg_shm_block_data(buffer->block), animation->width * 4);
+	bool ok = source && dest;
+	if (ok) {
+		pixman_image_composite32(PIXMAN_OP_SRC, source, NULL, dest,
+				0, 0, 0, 0, 0, 0, animation->width, animation->height);
+	} else {
+		wsbg_log(LOG_ERROR, "Creation of pixman image failed");
+	}
+	if (source) {
+		pixman_image_unref(source);
+	}
+	if (dest) {
+		pixman_image_unref(dest);
+	}
+	return ok;
+}
+
+/**
+ * Draws and commits the next frame if it is due, the compositor asked for
+ * one, and a buffer is free. Otherwise waits for whichever is missing.
+ */
+static void show_frame(struct animation *animation) {
+	if (!animation->iter || animation->frame_callback ||
+			(!animation->covered && (animation->deadline == -1 ||
+			animation->deadline > get_time_ms()))) {
+		return;
+	}
+	struct frame_buffer *buffer = get_frame_buffer(animation);
+	if (!buffer) {
+		animation->starved = true;
+		return;
+	}
+
+	// Frames skipped while waiting aren't drawn at all, and covered ones
+	// are drawn again until the next one is due
+	if (animation->covered) {
+		animation->covered = false;
+	} else {
+		gdk_pixbuf_animation_iter_advance(animation->iter, NULL);
+		int delay = gdk_pixbuf_animation_iter_get_delay_time(animation->iter);
+		animation->deadline = delay < 0 ? -1 : get_time_ms() + delay;
+	}
+	if (!draw_frame(animation, buffer)) {
+		return;
+	}
+
+	struct wsbg_output *output = animation->output;
+	struct wl_surface *surface = animation->surface;
+	wl_surface_attach(surface, buffer->buffer, 0, 0);
+	// Frames are upright, unlike buffers of rotated outputs
+	wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_surface_damage_buffer(surface, 0, 0, INT32_MAX, INT32_MAX);
+	if (surface == output->surface) {
+		// Keeps the viewport valid for commits of the output
+		output->source = animation->source;
+	}
+
+	struct wp_viewport *viewport = wp_viewporter_get_viewport(
+			output->state->viewporter, surface);
+	wp_viewport_set_source(viewport,
+			animation->source.x, animation->source.y,
+			animation->source.width, animation->source.height);
+	wp_viewport_set_destination(viewport,
+			animation->box.width, animation->box.height);
+
+	animation->frame_callback = wl_surface_frame(surface);
+	wl_callback_add_listener(animation->frame_callback,
+			&frame_listener, animation);
+	wl_surface_commit(surface);
+	buffer->busy = true;
+
+	wp_viewport_destroy(viewport);
+}
+
+/**
+ * Finds where frames are shown like the buffers of the config: over the
+ * whole output, or on its image subsurface if the config is letterboxed.
+ * Sets the part of a frame shown there, in the buffer size of the output.
+ * Returns false if frames don't fit there by cropping and scaling, as when
+ * they are tiled.
+ */
+static bool place_frames(struct animation *animation,
+		int32_t width, int32_t height) {
+	struct wsbg_output *output = animation->output;
+	struct wsbg_config *config = output->config;
+	switch (config->mode) {
+	case BACKGROUND_MODE_STRETCH:
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_FIT:
+	case BACKGROUND_MODE_CENTER:
+		break;
+	default:
+		return false;
+	}
+
+	struct wsbg_box box = {
+		.width = output->width,
+		.height = output->height,
+	};
+	animation->surface = output->surface;
+	if (config->background) {
+		if (!output->image_subsurface) {
+			return false;
+		}
+		box = config->box;
+		animation->surface = output->image_surface;
+	}
+
+	struct wsbg_image frame = {
+		.width = animation->width,
+		.height = animation->height,
+	};
+	struct wsbg_image_transform view;
+	bool covered;
+	get_wsbg_image_transform(&frame, config->mode, config->position,
+			width, height, &view, &covered);
+
+	// Part of the frame under the box, in Q16 frame pixels
+	int64_t box_x1 = (int64_t)box.x * width * Q16 / output->width;
+	int64_t box_y1 = (int64_t)box.y * height * Q16 / output->height;
+	int64_t box_x2 = (int64_t)(box.x + box.width) * width * Q16 / output->width;
+	int64_t box_y2 =
+		(int64_t)(box.y + box.height) * height * Q16 / output->height;
+	int64_t x1 = (box_x1 + view.x) * view.scale_x / Q16;
+	int64_t y1 = (box_y1 + view.y) * view.scale_y / Q16;
+	int64_t x2 = (box_x2 + view.x) * view.scale_x / Q16;
+	int64_t y2 = (box_y2 + view.y) * view.scale_y / Q16;
+
+	// Letterboxes are widened to whole surface coordinates, so frames may
+	// leave a pixel of the box uncovered
+	int64_t slack_x = view.scale_x * width / output->width + Q16;
+	int64_t slack_y = view.scale_y * height / output->height + Q16;
+	int64_t frame_width = frame.width * Q16;
+	int64_t frame_height = frame.height * Q16;
+	if (x1 < -slack_x || y1 < -slack_y ||
+			frame_width + slack_x < x2 || frame_height + slack_y < y2) {
+		return false;
+	}
+	x1 = x1 < 0 ? 0 : x1;
+	y1 = y1 < 0 ? 0 : y1;
+	x2 = x2 > frame_width ? frame_width : x2;
+	y2 = y2 > frame_height ? frame_height : y2;
+
+	// From Q16 frame pixels to wl_fixed_t
+	animation->source = (struct wsbg_source){
+		.x = x1 / 256,
+		.y = y1 / 256,
+		.width = x2 / 256 - x1 / 256,
+		.height = y2 / 256 - y1 / 256,
+	};
+	animation->box = box;
+	return animation->source.width > 0 && animation->source.height > 0 &&
+		box.width > 0 && box.height > 0;
+}
+
+static void destroy_animation(struct animation *animation) {
+	wl_list_remove(&animation->link);
+	if (animation->frame_callback) {
+		wl_callback_destroy(animation->frame_callback);
+	}
+	if (animation->surface &&
+			animation->surface == animation->output->image_surface) {
+		wl_subsurface_set_sync(animation->output->image_subsurface);
+	}
+
+	// The compositor may still read the frame shown last
+	struct frame_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &animation->buffers, link) {
+		if (buffer->busy) {
+			buffer->animation = NULL;
+			wl_list_remove(&buffer->link);
+			wl_list_insert(&animation->animator->retired, &buffer->link);
+		} else {
+			destroy_frame_buffer(buffer);
+		}
+	}
+
+	if (animation->iter) {
+		g_object_unref(animation->iter);
+	}
+	if (animation->composited) {
+		g_object_unref(animation->composited);
+	}
+	if (animation->pixbuf_animation) {
+		g_object_unref(animation->pixbuf_animation);
+	}
+	free(animation);
+}
+
+/**
+ * Returns whether `image` was parsed, and sets `pixbuf_animation` to its
+ * animation, or to NULL if it isn't animated. Otherwise has it parsed, and
+ * before the images asked for earlier.
+ */
+static bool get_pixbuf_animation(struct wsbg_animator *animator,
+		struct wsbg_image *image, GdkPixbufAnimation **pixbuf_animation) {
+	*pixbuf_animation = NULL;
+	bool loaded = true;
+	pthread_mutex_lock(&animator->lock);
+	struct animated_image *animated;
+	wl_list_for_each(animated, &animator->images, link) {
+		if (animated->image == image) {
+			loaded = animated->loaded;
+			*pixbuf_animation = animated->pixbuf_animation;
+			goto unlock;
+		}
+	}
+
+	if (!(animated = calloc(1, sizeof *animated)) ||
+			!(animated->path = strdup(image->path))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		free(animated);
+		goto unlock;
+	}
+	animated->image = image;
+	wl_list_insert(&animator->images, &animated->link);
+	pthread_cond_signal(&animator->cond);
+	loaded = false;
+
+unlock:
+	pthread_mutex_unlock(&animator->lock);
+	return loaded;
+}
+
+/**
+ * Plays `pixbuf_animation` in `animation`. Its first frame is the still
+ * image already shown. Returns false if it can't be played there.
+ */
+static bool play_animation(struct animation *animation,
+		GdkPixbufAnimation *pixbuf_animation) {
+	struct wsbg_output *output = animation->output;
+	animation->pixbuf_animation = g_object_ref(pixbuf_animation);
+	animation->width = gdk_pixbuf_animation_get_width(pixbuf_animation);
+	animation->height = gdk_pixbuf_animation_get_height(pixbuf_animation);
+	if (!place_frames(animation,
+			animation->buffer_width, animation->buffer_height)) {
+		wsbg_log(LOG_DEBUG, "Unable to animate %s in this mode",
+				output->config->image->path);
+		return false;
+	}
+	animation->composited = gdk_pixbuf_new(GDK_COLORSPACE_RGB, true, 8,
+			animation->width, animation->height);
+	if (!animation->composited) {
+		wsbg_log(LOG_ERROR, "Memory allocation failed");
+		return false;
+	}
+
+	animation->iter = gdk_pixbuf_animation_get_iter(pixbuf_animation, NULL);
+	int delay = gdk_pixbuf_animation_iter_get_delay_time(animation->iter);
+	if (delay < 0) {
+		return false;
+	}
+	animation->deadline = get_time_ms() + delay;
+
+	// Frames of the image subsurface are shown without committing the
+	// output surface
+	if (animation->surface == output->image_surface) {
+		wl_subsurface_set_desync(output->image_subsurface);
+	}
+	return true;
+}
+
+/**
+ * Places the frames of a playing animation over the still buffers just
+ * shown, which covered its current frame. Returns false if they no longer
+ * fit there.
+ */
+static bool replace_frames(struct animation *animation) {
+	struct wsbg_output *output = animation->output;
+	struct wl_surface *surface = animation->surface;
+	if (!place_frames(animation,
+			animation->buffer_width, animation->buffer_height)) {
+		wsbg_log(LOG_DEBUG, "Unable to animate %s in this mode",
+				output->config->image->path);
+		animation->surface = surface;
+		return false;
+	}
+	if (animation->surface != surface) {
+		// The frame callback is for the other surface
+		if (animation->frame_callback) {
+			wl_callback_destroy(animation->frame_callback);
+			animation->frame_callback = NULL;
+		}
+		if (animation->surface == output->image_surface) {
+			wl_subsurface_set_desync(output->image_subsurface);
+		} else {
+			wl_subsurface_set_sync(output->image_subsurface);
+		}
+	}
+	animation->covered = true;
+	return true;
+}
+
+struct wsbg_animator *wsbg_animator_create(struct wsbg_state *state) {
+	struct wsbg_animator *animator = calloc(1, sizeof *animator);
+	if (!animator) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	animator->state = state;
+	wl_list_init(&animator->animations);
+	wl_list_init(&animator->retired);
+	wl_list_init(&animator->images);
+	pthread_mutex_init(&animator->lock, NULL);
+	pthread_cond_init(&animator->cond, NULL);
+	animator->fd = -1;
+
+	animator->timer = timerfd_create(CLOCK_MONOTONIC,
+			TFD_CLOEXEC | TFD_NONBLOCK);
+	if (animator->timer == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to create animation timer");
+		goto error;
+	}
+	animator->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (animator->fd == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to create eventfd");
+		goto error;
+	}
+	// Frames are drawn on the main thread, which may not share the pools
+	// of the render thread
+	if (!(animator->pools = wsbg_shm_create(state->shm, false))) {
+		goto error;
+	}
+
+	int err = pthread_create(&animator->thread, NULL, load_main, animator);
+	if (err) {
+		errno = err;
+		wsbg_log_errno(LOG_ERROR, "Unable to start animation thread");
+		wsbg_shm_destroy(animator->pools);
+		goto error;
+	}
+	return animator;
+
+error:
+	if (animator->fd != -1) {
+		close(animator->fd);
+	}
+	if (animator->timer != -1) {
+		close(animator->timer);
+	}
+	pthread_cond_destroy(&animator->cond);
+	pthread_mutex_destroy(&animator->lock);
+	free(animator);
+	return NULL;
+}
+
+void wsbg_animator_destroy(struct wsbg_animator *animator) {
+	if (!animator) {
+		return;
+	}
+	pthread_mutex_lock(&animator->lock);
+	animator->exit = true;
+	pthread_cond_signal(&animator->cond);
+	pthread_mutex_unlock(&animator->lock);
+	pthread_join(animator->thread, NULL);
+
+	struct animation *animation, *tmp_animation;
+	wl_list_for_each_safe(animation, tmp_animation,
+			&animator->animations, link) {
+		destroy_animation(animation);
+	}
+	struct frame_buffer *buffer, *tmp_buffer;
+	wl_list_for_each_safe(buffer, tmp_buffer, &animator->retired, link) {
+		destroy_frame_buffer(buffer);
+	}
+	struct animated_image *image, *tmp_image;
+	wl_list_for_each_safe(image, tmp_image, &animator->images, link) {
+		destroy_animated_image(image);
+	}
+	wsbg_shm_destroy(animator->pools);
+	close(animator->fd);
+	close(animator->timer);
+	pthread_cond_destroy(&animator->cond);
+	pthread_mutex_destroy(&animator->lock);
+	free(animator);
+}
+
+int wsbg_animator_get_fd(struct wsbg_animator *animator) {
+	return animator->timer;
+}
+
+int wsbg_animator_get_load_fd(struct wsbg_animator *animator) {
+	return animator->fd;
+}
+
+void wsbg_animator_start(struct wsbg_animator *animator,
+		struct wsbg_output *output, int32_t width, int32_t height) {
+	struct wsbg_config *config = output->config;
+	struct animation *animation;
+	wl_list_for_each(animation, &animator->animations, link) {
+		if (animation->output != output) {
+			continue;
+		}
+		if (animation->image != config->image ||
+				config->mode == BACKGROUND_MODE_SOLID_COLOR) {
+			destroy_animation(animation);
+			break;
+		}
+		// The same image keeps playing rather than starting over
+		animation->buffer_width = width;
+		animation->buffer_height = height;
+		if (animation->pixbuf_animation && !replace_frames(animation)) {
+			destroy_animation(animation);
+		}
+		arm_timer(animator);
+		return;
+	}
+	if (!config->image || config->mode == BACKGROUND_MODE_SOLID_COLOR ||
+			config->image->is_directory) {
+		arm_timer(animator);
+		return;
+	}
+
+	GdkPixbufAnimation *pixbuf_animation;
+	bool loaded =
+		get_pixbuf_animation(animator, config->image, &pixbuf_animation);
+	if (loaded && !pixbuf_animation) {
+		arm_timer(animator);
+		return;
+	}
+
+	if (!(animation = calloc(1, sizeof *animation))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		arm_timer(animator);
+		return;
+	}
+	animation->animator = animator;
+	animation->output = output;
+	animation->image = config->image;
+	animation->buffer_width = width;
+	animation->buffer_height = height;
+	animation->deadline = -1;
+	wl_list_init(&animation->buffers);
+	wl_list_insert(&animator->animations, &animation->link);
+
+	// Otherwise it starts playing once loaded
+	if (loaded && !play_animation(animation, pixbuf_animation)) {
+		destroy_animation(animation);
+	}
+	arm_timer(animator);
+}
+
+void wsbg_animator_stop(struct wsbg_animator *animator,
+		struct wsbg_output *output) {
+	struct animation *animation;
+	wl_list_for_each(animation, &animator->animations, link) {
+		if (animation->output == output) {
+			destroy_animation(animation);
+			arm_timer(animator);
+			return;
+		}
+	}
+}
+
+void wsbg_animator_forget(struct wsbg_animator *animator,
+		struct wsbg_image *image) {
+	struct animation *animation, *tmp_animation;
+	wl_list_for_each_safe(animation, tmp_animation,
+			&animator->animations, link) {
+		if (animation->image == image) {
+			destroy_animation(animation);
+		}
+	}
+	arm_timer(animator);
+
+	pthread_mutex_lock(&animator->lock);
+	struct animated_image *animated, *tmp_animated;
+	wl_list_for_each_safe(animated, tmp_animated, &animator->images, link) {
+		if (animated->image != image) {
+			continue;
+		}
+		wl_list_remove(&animated->link);
+		if (animated == animator->loading) {
+			// Freed by the thread once it's done
+			animated->image = NULL;
+		} else {
+			destroy_animated_image(animated);
+		}
+	}
+	pthread_mutex_unlock(&animator->lock);
+}
+
+void wsbg_animator_dispatch(struct wsbg_animator *animator) {
+	uint64_t expirations;
+	if (read(animator->timer, &expirations, sizeof expirations) == -1 &&
+			errno != EAGAIN) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read animation timer");
+	}
+	eventfd_t count;
+	if (eventfd_read(animator->fd, &count) == -1 && errno != EAGAIN) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read animation eventfd");
+	}
+
+	struct animation *animation, *tmp;
+	wl_list_for_each_safe(animation, tmp, &animator->animations, link) {
+		if (animation->pixbuf_animation) {
+			show_frame(animation);
+			continue;
+		}
+		GdkPixbufAnimation *pixbuf_animation;
+		if (get_pixbuf_animation(animator, animation->image,
+				&pixbuf_animation) && (!pixbuf_animation ||
+				!play_animation(animation, pixbuf_animation))) {
+			destroy_animation(animation);
+		}
+	}
+	arm_timer(animator);
+}
+
+#else // !HAVE_GDK_PIXBUF
+
+struct wsbg_animator *wsbg_animator_create(struct wsbg_state *state) {
+	return NULL;
+}
+
+void wsbg_animator_destroy(struct wsbg_animator *animator) {
+}
+
+int wsbg_animator_get_fd(struct wsbg_animator *animator) {
+	return -1;
+}
+
+int wsbg_animator_get_load_fd(struct wsbg_animator *animator) {
+	return -1;
+}
+
+void wsbg_animator_start(struct wsbg_animator *animator,
+		struct wsbg_output *output, int32_t width, int32_t height) {
+}
+
+void wsbg_animator_stop(struct wsbg_animator *animator,
+		struct wsbg_output *output) {
+}
+
+void wsbg_animator_forget(struct wsbg_animator *animator,
+		struct wsbg_image *image) {
+}
+
+void wsbg_animator_dispatch(struct wsbg_animator *animator) {
+}
+
+#endif // HAVE_GDK_PIXBUF
@@ -0,0 +1,81 @@
+/*
+ * Times lookups in the buffer cache as it grows, which should take about
+ * the same time whatever its size. Run with `meson test --benchmark`.
+ */
+#define _POSIX_C_SOURCE 200809
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <wayland-client.h>
+#include "buffer-cache.h"
+#include "log.h"
+
+#define BUFFERS_MAX (1 << 16)
+#define LOOKUPS (1 << 22)
+
+static int64_t get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Sets the key of the `i`th buffer, for an image of one of a few hundred
+ * workspaces, at one of a few sizes.
+ */
+static void set_key(struct wsbg_buffer *key, struct wsbg_image *images,
+		size_t i) {
+	*key = (struct wsbg_buffer){
+		.image = &images[i % 256],
+		.width = 1920 + (int32_t)(i / 256),
+		.height = 1080,
+		.format = WL_SHM_FORMAT_XRGB8888,
+		.transform = { .scale_x = Q16, .scale_y = Q16 },
+		.background = { .a = 0xFF },
+	};
+}
+
+int main(void) {
+	struct wsbg_image *images = calloc(256, sizeof *images);
+	struct wsbg_buffer *buffers = calloc(BUFFERS_MAX, sizeof *buffers);
+	if (!images || !buffers) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return 1;
+	}
+
+	printf("%8s %12s\n", "buffers", "ns/lookup");
+	size_t count = 0;
+	for (size_t size = 16; size <= BUFFERS_MAX; size *= 4) {
+		for (; count < size; ++count) {
+			// Missing lookups set the hash
+			set_key(&buffers[count], images, count);
+			buffer_cache_find(&buffers[count]);
+			buffers[count].ref_count = 1;
+			buffer_cache_insert(&buffers[count]);
+		}
+
+		// Buffers are looked up in a scattered order, as workspaces are
+		size_t found = 0;
+		int64_t start = get_time_ns();
+		for (size_t i = 0; i < LOOKUPS; ++i) {
+			struct wsbg_buffer key;
+			set_key(&key, images, i * 40503 % count);
+			found += buffer_cache_find(&key) != NULL;
+		}
+		int64_t time = get_time_ns() - start;
+		if (found != LOOKUPS) {
+			wsbg_log(LOG_ERROR, "Only %zu of %d lookups found a buffer",
+					found, LOOKUPS);
+			return 1;
+		}
+		printf("%8zu %12.1f\n", count, (double)time / LOOKUPS);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		buffer_cache_remove(&buffers[i]);
+	}
+	free(buffers);
+	free(images);
+	return 0;
+}
@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200809
+#include <pixman.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "blit.h"
+
+static int32_t floor_mod(int32_t x, int32_t y) {
+	int32_t mod = x % y;
+	return mod < 0 ? mod + y : mod;
+}
+
+static inline uint32_t load_24(const uint8_t *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+#else
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+#endif
+}
+
+static inline uint32_t swap_red_blue(uint32_t x) {
+	return (x & 0x00FF00) | (x & 0xFF) << 16 | (x >> 16 & 0xFF);
+}
+
+/**
+ * Returns source pixel `i` of `row` as x8r8g8b8.
+ */
+static inline uint32_t load_pixel(const uint8_t *row, int32_t i,
+		pixman_format_code_t format) {
+	uint32_t x;
+	switch (format) {
+	case PIXMAN_r8g8b8:
+		return 0xFF000000 | load_24(row + i * 3);
+	case PIXMAN_b8g8r8:
+		return 0xFF000000 | swap_red_blue(load_24(row + i * 3));
+	case PIXMAN_x8b8g8r8:
+		memcpy(&x, row + i * 4, 4);
+		return 0xFF000000 | swap_red_blue(x);
+	case PIXMAN_r8g8b8x8:
+		memcpy(&x, row + i * 4, 4);
+		return 0xFF000000 | x >> 8;
+	default:
+		memcpy(&x, row + i * 4, 4);
+		return 0xFF000000 | x;
+	}
+}
+
+static inline void convert_pixels(uint32_t *dest, const uint8_t *row,
+		int32_t count, pixman_format_code_t format, bool stream) {
+	int32_t i = 0;
+#ifdef __SSE2__
+	if (stream) {
+		for (; i < count && ((uintptr_t)(dest + i) & 15); ++i) {
+			dest[i] = load_pixel(row, i, format);
+		}
+		for (; i + 4 <= count; i += 4) {
+			__m128i pixels = _mm_setr_epi32(
+					load_pixel(row, i, format),
+					load_pixel(row, i + 1, format),
+					load_pixel(row, i + 2, format),
+					load_pixel(row, i + 3, format));
+			_mm_stream_si128((__m128i *)(dest + i), pixels);
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		dest[i] = load_pixel(row, i, format);
+	}
+}
+
+/**
+ * Converts a row of `format` to x8r8g8b8. Every supported format gets a
+ * loop of its own, so that the format isn't checked for every pixel.
+ */
+static void convert_row(uint32_t *dest, const uint8_t *row, int32_t count,
+		pixman_format_code_t format, bool stream) {
+	switch (format) {
+	case PIXMAN_r8g8b8:
+		convert_pixels(dest, row, count, PIXMAN_r8g8b8, stream);
+		break;
+	case PIXMAN_b8g8r8:
+		convert_pixels(dest, row, count, PIXMAN_b8g8r8, stream);
+		break;
+	case PIXMAN_x8b8g8r8:
+		convert_pixels(dest, row, count, PIXMAN_x8b8g8r8, stream);
+		break;
+	case PIXMAN_r8g8b8x8:
+		convert_pixels(dest, row, count, PIXMAN_r8g8b8x8, stream);
+		break;
+	default:
+		convert_pixels(dest, row, count, PIXMAN_x8r8g8b8, stream);
+		break;
+	}
+}
+
+static bool can_convert(pixman_format_code_t format) {
+	switch (format) {
+	case PIXMAN_r8g8b8:
+	case PIXMAN_b8g8r8:
+	case PIXMAN_x8b8g8r8:
+	case PIXMAN_r8g8b8x8:
+	case PIXMAN_x8r8g8b8:
+	case PIXMAN_a8r8g8b8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void fill_row(uint32_t *dest, int32_t count, uint32_t pixel,
+		bool stream) {
+	int32_t i = 0;
+#ifdef __SSE2__
+	if (stream) {
+		for (; i < count && ((uintptr_t)(dest + i) & 15); ++i) {
+			dest[i] = pixel;
+		}
+		__m128i pixels = _mm_set1_epi32(pixel);
+		for (; i + 4 <= count; i += 4) {
+			_mm_stream_si128((__m128i *)(dest + i), pixels);
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		dest[i] = pixel;
+	}
+}
+
+/**
+ * Copies `size` bytes. Only whole cache lines are streamed, since lines that
+ * are partly streamed and partly stored are slow to write out. Sources that
+ * can't be loaded aligned are left to memcpy, which copies them faster.
+ */
+static void copy_row(uint8_t *dest, const uint8_t *source, size_t size,
+		bool stream) {
+	size_t i = 0;
+#ifdef __SSE2__
+	if (stream && ((uintptr_t)dest & 15) == ((uintptr_t)source & 15)) {
+		i = -(uintptr_t)dest & 63;
+		i = i < size ? i : size;
+		memcpy(dest, source, i);
+		for (; i + 64 <= size; i += 64) {
+			for (size_t j = i; j < i + 64; j += 16) {
+				__m128i pixels = _mm_load_si128((const __m128i *)(source + j));
+				_mm_stream_si128((__m128i *)(dest + j), pixels);
+			}
+		}
+	}
+#endif
+	memcpy(dest + i, source + i, size - i);
+}
+
+static void end_stream(bool stream) {
+#ifdef __SSE2__
+	if (stream) {
+		// Order the streamed stores before the buffer is handed over
+		_mm_sfence();
+	}
+#endif
+}
+
+void blit_fill(pixman_image_t *dest, const pixman_color_t *color,
+		const pixman_box32_t *boxes, int count, bool stream) {
+	if (pixman_image_get_format(dest) != PIXMAN_x8r8g8b8) {
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, dest, color, count, boxes);
+		return;
+	}
+
+	uint8_t *data = (uint8_t *)pixman_image_get_data(dest);
+	int stride = pixman_image_get_stride(dest);
+	uint32_t pixel = UINT32_C(0xFF000000) |
+		(uint32_t)(color->red >> 8) << 16 |
+		(uint32_t)(color->green >> 8) << 8 |
+		(uint32_t)(color->blue >> 8);
+	for (int i = 0; i < count; ++i) {
+		for (int32_t y = boxes[i].y1; y < boxes[i].y2; ++y) {
+			fill_row((uint32_t *)(data + y * stride) + boxes[i].x1,
+					boxes[i].x2 - boxes[i].x1, pixel, stream);
+		}
+	}
+	end_stream(stream);
+}
+
+void blit_copy(pixman_image_t *dest, int32_t dest_x, int32_t dest_y,
+		pixman_image_t *source, int32_t x, int32_t y,
+		int32_t width, int32_t height, bool stream) {
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	pixman_format_code_t format = pixman_image_get_format(dest);
+	pixman_format_code_t source_format = pixman_image_get_format(source);
+
+	uint8_t *data = (uint8_t *)pixman_image_get_data(dest);
+	int stride = pixman_image_get_stride(dest);
+	const uint8_t *source_data =
+		(const uint8_t *)pixman_image_get_data(source);
+	int source_stride = pixman_image_get_stride(source);
+
+	if (format == source_format) {
+		int bytes = PIXMAN_FORMAT_BPP(format) / 8;
+		for (int32_t i = 0; i < height; ++i) {
+			copy_row(data + (dest_y + i) * stride + dest_x * bytes,
+					source_data + (y + i) * source_stride + x * bytes,
+					(size_t)width * bytes, stream);
+		}
+		end_stream(stream);
+	} else if (format == PIXMAN_x8r8g8b8 && can_convert(source_format)) {
+		int bytes = PIXMAN_FORMAT_BPP(source_format) / 8;
+		for (int32_t i = 0; i < height; ++i) {
+			convert_row((uint32_t *)(data + (dest_y + i) * stride) + dest_x,
+					source_data + (y + i) * source_stride + x * bytes,
+					width, source_format, stream);
+		}
+		end_stream(stream);
+	} else {
+		// Untransformed, so pixman converts whole rows at a time
+		pixman_image_composite32(PIXMAN_OP_SRC, source, NULL, dest,
+				x, y, 0, 0, dest_x, dest_y, width, height);
+	}
+}
+
+void blit_tile(pixman_image_t *dest, pixman_image_t *source,
+		int32_t x, int32_t y, bool stream) {
+	int32_t width = pixman_image_get_width(dest);
+	int32_t height = pixman_image_get_height(dest);
+	int32_t source_width = pixman_image_get_width(source);
+	int32_t source_height = pixman_image_get_height(source);
+	if (width <= 0 || height <= 0 || source_width <= 0 || source_height <= 0) {
+		return;
+	}
+	x = floor_mod(x, source_width);
+	y = floor_mod(y, source_height);
+
+	// Draw a single tile at the top left, split where the source wraps. It
+	// is read back below unless it covers everything, so only then stream it
+	int32_t tile_width = width < source_width ? width : source_width;
+	int32_t tile_height = height < source_height ? height : source_height;
+	int32_t right = source_width - x < tile_width ?
+			source_width - x : tile_width;
+	int32_t bottom = source_height - y < tile_height ?
+			source_height - y : tile_height;
+	bool stream_tile = stream && tile_width == width && tile_height == height;
+	blit_copy(dest, 0, 0, source, x, y, right, bottom, stream_tile);
+	blit_copy(dest, right, 0, source, 0, y,
+			tile_width - right, bottom, stream_tile);
+	blit_copy(dest, 0, bottom, source, x, 0,
+			right, tile_height - bottom, stream_tile);
+	blit_copy(dest, right, bottom, source, 0, 0,
+			tile_width - right, tile_height - bottom, stream_tile);
+
+	// Then keep doubling it across, in the caches
+	uint8_t *data = (uint8_t *)pixman_image_get_data(dest);
+	int stride = pixman_image_get_stride(dest);
+	int bytes = PIXMAN_FORMAT_BPP(pixman_image_get_format(dest)) / 8;
+	for (int32_t i = 0; i < tile_height; ++i) {
+		uint8_t *row = data + i * stride;
+		for (int32_t done = tile_width; done < width; done *= 2) {
+			int32_t count = width - done < done ? width - done : done;
+			memcpy(row + done * bytes, row, count * bytes);
+		}
+	}
+	// And repeat those rows down. Streamed rows would be read back from
+	// memory, so each row is copied from the first ones rather than doubled
+	for (int32_t i = tile_height; i < height; ++i) {
+		copy_row(data + i * stride, data + (i % tile_height) * stride,
+				(size_t)width * bytes, stream);
+	}
+	end_stream(stream);
+}
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <wayland-client.h>
+#include "buffer-cache.h"
+#include "log.h"
+
+// Initial number of buckets
+#define CACHE_BUCKETS_MIN 64
+
+/**
+ * Hash table of all buffers, chained through wsbg_buffer::link. Grows to
+ * keep about one buffer per bucket, so lookups take the same time however
+ * many buffers there are.
+ */
+static struct {
+	struct wl_list *buckets;
+	size_t size, count;
+} cache;
+
+static uint32_t hash_u32(uint32_t hash, uint32_t value) {
+	// FNV-1a, a byte at a time
+	for (int i = 0; i < 4; ++i) {
+		hash = (hash ^ (value & 0xFF)) * UINT32_C(16777619);
+		value >>= 8;
+	}
+	return hash;
+}
+
+static uint32_t hash_key(const struct wsbg_buffer *key) {
+	uint32_t hash = UINT32_C(2166136261);
+	hash = hash_u32(hash, (uint32_t)(uintptr_t)key->image);
+#if UINTPTR_MAX > UINT32_MAX
+	hash = hash_u32(hash, (uint32_t)((uintptr_t)key->image >> 32));
+#endif
+	hash = hash_u32(hash, key->width);
+	hash = hash_u32(hash, key->height);
+	hash = hash_u32(hash, key->format);
+	hash = hash_u32(hash, key->transform.x);
+	hash = hash_u32(hash, key->transform.y);
+	hash = hash_u32(hash, key->transform.scale_x);
+	hash = hash_u32(hash, key->transform.scale_y);
+	hash = hash_u32(hash, (uint32_t)key->background.r << 24 |
+			(uint32_t)key->background.g << 16 |
+			(uint32_t)key->background.b << 8 | key->background.a);
+	hash = hash_u32(hash, key->repeat);
+	hash = hash_u32(hash, key->rotation);
+	return hash_u32(hash, key->filter);
+}
+
+static bool key_eql(const struct wsbg_buffer *a, const struct wsbg_buffer *b) {
+	return a->image == b->image &&
+		a->width == b->width && a->height == b->height &&
+		a->format == b->format &&
+		transform_eql(a->transform, b->transform) &&
+		color_eql(a->background, b->background) &&
+		a->repeat == b->repeat &&
+		a->filter == b->filter &&
+		a->rotation == b->rotation;
+}
+
+struct wsbg_buffer *buffer_cache_find(struct wsbg_buffer *key) {
+	key->hash = hash_key(key);
+	if (!cache.size) {
+		return NULL;
+	}
+	struct wsbg_buffer *buffer;
+	wl_list_for_each(buffer, &cache.buckets[key->hash & (cache.size - 1)],
+			link) {
+		if (buffer->hash == key->hash && key_eql(buffer, key)) {
+			++buffer->ref_count;
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static void cache_resize(size_t size) {
+	struct wl_list *buckets = calloc(size, sizeof *buckets);
+	if (!buckets) {
+		// Longer chains still work
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return;
+	}
+	for (size_t i = 0; i < size; ++i) {
+		wl_list_init(&buckets[i]);
+	}
+	for (size_t i = 0; i < cache.size; ++i) {
+		struct wsbg_buffer *buffer, *tmp;
+		wl_list_for_each_safe(buffer, tmp, &cache.buckets[i], link) {
+			wl_list_remove(&buffer->link);
+			wl_list_insert(&buckets[buffer->hash & (size - 1)], &buffer->link);
+		}
+	}
+	free(cache.buckets);
+	cache.buckets = buckets;
+	cache.size = size;
+}
+
+void buffer_cache_insert(struct wsbg_buffer *buffer) {
+	if (cache.count >= cache.size) {
+		cache_resize(cache.size ? cache.size * 2 : CACHE_BUCKETS_MIN);
+	}
+	if (cache.size) {
+		wl_list_insert(&cache.buckets[buffer->hash & (cache.size - 1)],
+				&buffer->link);
+	} else {
+		// Not shared, but released as usual
+		wl_list_init(&buffer->link);
+	}
+	++cache.count;
+}
+
+void buffer_cache_remove(struct wsbg_buffer *buffer) {
+	wl_list_remove(&buffer->link);
+	if (--cache.count == 0) {
+		free(cache.buckets);
+		cache.buckets = NULL;
+		cache.size = 0;
+	}
+}
+
+void buffer_cache_forget(struct wsbg_image *image) {
+	for (size_t i = 0; i < cache.size; ++i) {
+		struct wsbg_buffer *buffer, *tmp;
+		wl_list_for_each_safe(buffer, tmp, &cache.buckets[i], link) {
+			if (buffer->image == image) {
+				// Still counted, and released as usual
+				wl_list_remove(&buffer->link);
+				wl_list_init(&buffer->link);
+			}
+		}
+	}
+}
@@ -1,105 +1,206 @@
 #define _POSIX_C_SOURCE 200809
-#include <fcntl.h>
 #include <pixman.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <unistd.h>
 #include <wayland-client.h>
+#include "blit.h"
 #include "buffer.h"
+#include "buffer-cache.h"
+#include "disk-cache.h"
+#include "downscale.h"
 #include "image.h"
 #include "log.h"
+#include "preload.h"
+#include "shm.h"
+#include "workers.h"
 
-static struct wl_shm_pool *mmap_pool(
-		struct wsbg_buffer *buffer,
-		struct wl_shm *shm,
-		size_t size) {
-	static const char *template = "wsbg-XXXXXX";
-	const char *path = getenv("XDG_RUNTIME_DIR");
-	if (path == NULL) {
-		wsbg_log(LOG_ERROR, "XDG_RUNTIME_DIR is not set");
-		return NULL;
+// Smallest number of pixels worth handing to another thread
+#define BAND_PIXELS_MIN (1 << 18)
+
+// Smallest buffer written with streaming stores, roughly beyond the size
+// of a last level cache
+#define STREAM_SIZE_MIN ((size_t)8 << 20)
+
+// Number of filter kernels kept for reuse, one per scale
+#define FILTER_KERNELS_MAX 8
+
+// Smallest side of a mipmap
+#define MIPMAP_SIZE_MIN 64
+
+// Largest side of an image buffer scaled by the compositor
+#define SOURCE_SIZE_MAX 8192
+
+/**
+ * A pixel format of image buffers. Pixman formats are in host byte order,
+ * while wl_shm formats are little-endian.
+ */
+struct pixel_format {
+	const char *name;
+	uint32_t shm_format;
+	pixman_format_code_t pixman_format;
+	int32_t bytes;  // per pixel
+	bool dither;
+};
+
+static const struct pixel_format pixel_formats[] = {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	{ "xrgb8888", WL_SHM_FORMAT_XRGB8888, PIXMAN_b8g8r8x8, 4, false },
+#else
+	{ "xrgb8888", WL_SHM_FORMAT_XRGB8888, PIXMAN_x8r8g8b8, 4, false },
+	{ "rgb565", WL_SHM_FORMAT_RGB565, PIXMAN_r5g6b5, 2, true },
+	{ "xrgb2101010", WL_SHM_FORMAT_XRGB2101010, PIXMAN_x2r10g10b10, 4, false },
+#endif
+};
+
+static const struct pixel_format *find_pixel_format(uint32_t shm_format) {
+	for (size_t i = 0; i < sizeof pixel_formats / sizeof *pixel_formats; ++i) {
+		if (pixel_formats[i].shm_format == shm_format) {
+			return &pixel_formats[i];
+		}
 	}
+	return &pixel_formats[0];
+}
 
-	size_t name_size = strlen(template) + 1 + strlen(path) + 1;
-	char *name = malloc(name_size);
-	if (name == NULL) {
-		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
-		return NULL;
+bool parse_format(const char *str, uint32_t *format) {
+	for (size_t i = 0; i < sizeof pixel_formats / sizeof *pixel_formats; ++i) {
+		if (strcmp(str, pixel_formats[i].name) == 0) {
+			*format = pixel_formats[i].shm_format;
+			return true;
+		}
 	}
-	snprintf(name, name_size, "%s/%s", path, template);
+	return false;
+}
 
-	struct wl_shm_pool *pool = NULL;
-	int fd = mkstemp(name);
-	if (fd == -1) {
-		wsbg_log_errno(LOG_ERROR, "Temp file creation failed");
-		free(name);
-		return NULL;
+const char *get_format_name(uint32_t format) {
+	return find_pixel_format(format)->name;
+}
+
+static const char *filter_names[] = {
+	[WSBG_FILTER_FAST] = "fast",
+	[WSBG_FILTER_GOOD] = "good",
+	[WSBG_FILTER_BEST] = "best",
+	[WSBG_FILTER_LANCZOS] = "lanczos",
+};
+
+bool parse_filter(const char *str, enum wsbg_filter *filter) {
+	for (size_t i = 0; i < sizeof filter_names / sizeof *filter_names; ++i) {
+		if (strcmp(str, filter_names[i]) == 0) {
+			*filter = i;
+			return true;
+		}
 	}
+	return false;
+}
+
+/**
+ * Parameters of a separable convolution filter for one scale. Creating them
+ * takes longer than filtering a small buffer, and outputs of the same size
+ * all use the same scale.
+ */
+struct filter_kernel {
+	pixman_fixed_t scale_x, scale_y;
+	pixman_fixed_t *params;
+	int n_params;
+	struct wl_list link;
+};
+
+// Most recently used first, only used by the render thread
+static struct wl_list filter_kernels = { &filter_kernels, &filter_kernels };
+static int filter_kernel_count;
+
+static void destroy_filter_kernel(struct filter_kernel *kernel) {
+	wl_list_remove(&kernel->link);
+	--filter_kernel_count;
+	free(kernel->params);
+	free(kernel);
+}
+
+static pixman_kernel_t sample_kernel(pixman_fixed_t scale) {
+	return scale > Q16 ? PIXMAN_KERNEL_LANCZOS3 : PIXMAN_KERNEL_IMPULSE;
+}
+
+static pixman_kernel_t reconstruct_kernel(pixman_fixed_t scale) {
+	return scale < Q16 ? PIXMAN_KERNEL_LANCZOS3 : PIXMAN_KERNEL_IMPULSE;
+}
 
-	while (ftruncate(fd, size) == -1) {
-		if (errno == EINTR) {
-			continue;
+/**
+ * Returns a Lanczos kernel for scaling by `scale_x`x`scale_y` image pixels
+ * per buffer pixel, which filters when shrinking and interpolates when
+ * enlarging.
+ */
+static struct filter_kernel *get_filter_kernel(
+		pixman_fixed_t scale_x, pixman_fixed_t scale_y) {
+	struct filter_kernel *kernel;
+	wl_list_for_each(kernel, &filter_kernels, link) {
+		if (kernel->scale_x == scale_x && kernel->scale_y == scale_y) {
+			wl_list_remove(&kernel->link);
+			wl_list_insert(&filter_kernels, &kernel->link);
+			return kernel;
 		}
-		wsbg_log_errno(LOG_ERROR, "Temp file creation failed");
-		goto cleanup_and_return;
 	}
 
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		wsbg_log_errno(LOG_ERROR, "Shared memory map failed");
-		goto cleanup_and_return;
+	if (!(kernel = calloc(1, sizeof *kernel))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	kernel->scale_x = scale_x;
+	kernel->scale_y = scale_y;
+	kernel->params = pixman_filter_create_separable_convolution(
+			&kernel->n_params,
+			scale_x > Q16 ? scale_x : Q16, scale_y > Q16 ? scale_y : Q16,
+			reconstruct_kernel(scale_x), reconstruct_kernel(scale_y),
+			sample_kernel(scale_x), sample_kernel(scale_y), 4, 4);
+	if (!kernel->params) {
+		wsbg_log(LOG_ERROR, "Creation of filter kernel failed");
+		free(kernel);
+		return NULL;
 	}
 
-	pool = wl_shm_create_pool(shm, fd, size);
-	buffer->size = size;
-	buffer->data = data;
+	if (filter_kernel_count == FILTER_KERNELS_MAX) {
+		destroy_filter_kernel(
+				wl_container_of(filter_kernels.prev, kernel, link));
+	}
+	wl_list_insert(&filter_kernels, &kernel->link);
+	++filter_kernel_count;
+	return kernel;
+}
 
-cleanup_and_return:
-	close(fd);
-	unlink(name);
-	free(name);
-	return pool;
+void unload_wsbg_filters(void) {
+	while (!wl_list_empty(&filter_kernels)) {
+		struct filter_kernel *kernel =
+			wl_container_of(filter_kernels.next, kernel, link);
+		destroy_filter_kernel(kernel);
+	}
 }
 
+// Protects the buffer cache and reference counts, which are used by both
+// the render thread and the event loop
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared memory held by all buffers, in bytes
+static atomic_size_t buffer_memory;
+
 static void munmap_buffer(struct wsbg_buffer *buffer) {
 	if (buffer->buffer) {
 		wl_buffer_destroy(buffer->buffer);
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
-	}
+	wsbg_shm_free(buffer->block);
+	atomic_fetch_sub(&buffer_memory, buffer->size);
 }
 
 static bool mmap_buffer(
 		struct wsbg_buffer *buffer, struct wsbg_state *state,
-		int32_t width, int32_t height, pixman_image_t **surface_ptr) {
-	uint32_t stride = width * 4;
-	size_t size = stride * height;
-
-	struct wl_shm_pool *pool = mmap_pool(buffer, state->shm, size);
-	if (!pool) {
+		int32_t width, int32_t height, int32_t stride) {
+	buffer->block = wsbg_shm_alloc(state->pools, width, height, stride,
+			state->format, &buffer->buffer);
+	if (!buffer->block) {
 		return false;
 	}
-	buffer->buffer = wl_shm_pool_create_buffer(pool, 0,
-			width, height, stride, WL_SHM_FORMAT_XRGB8888);
-	wl_shm_pool_destroy(pool);
-
-	if (surface_ptr) {
-		pixman_format_code_t format =
-			(*(char *)(int[]){1}) ? PIXMAN_x8r8g8b8 : PIXMAN_b8g8r8x8;
-
-		*surface_ptr = pixman_image_create_bits_no_clear(
-				format, width, height, buffer->data, stride);
-
-		if (!*surface_ptr) {
-			wsbg_log(LOG_ERROR, "Creation of pixman image failed");
-			munmap_buffer(buffer);
-			return false;
-		}
-	}
+	buffer->size = (size_t)height * stride;
+	atomic_fetch_add(&buffer_memory, buffer->size);
 	return true;
 }
 
@@ -121,141 +222,1001 @@ static bool mmap_color_buffer(
 	}
 
 	uint8_t data[] = { color.b, color.g, color.r, color.a };
-	struct wl_shm_pool *pool = mmap_pool(buffer, state->shm, sizeof data);
-	if (!pool) {
+	buffer->block = wsbg_shm_alloc(state->pools, 1, 1, sizeof data,
+	        color.a == 0xFF ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888,
+			&buffer->buffer);
+	if (!buffer->block) {
 		return false;
 	}
-	buffer->buffer = wl_shm_pool_create_buffer(pool, 0, 1, 1, sizeof data,
-	        color.a == 0xFF ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888);
-	wl_shm_pool_destroy(pool);
-	memcpy(buffer->data, &data, sizeof data);
+	memcpy(wsbg_shm_block_data(buffer->block), &data, sizeof data);
+	buffer->size = sizeof data;
+	atomic_fetch_add(&buffer_memory, buffer->size);
 	return true;
 }
 
-static struct wsbg_buffer *get_wsbg_color_buffer(
+struct wsbg_buffer *get_wsbg_color_buffer(
 		struct wsbg_state *state,
 		struct wsbg_color color) {
-	struct wsbg_buffer *buffer;
-	wl_list_for_each(buffer, &state->colors, link) {
-		if (color_eql(buffer->background, color)) {
-			++buffer->ref_count;
-			return buffer;
-		}
+	struct wsbg_buffer key = { .background = color };
+	pthread_mutex_lock(&cache_lock);
+	struct wsbg_buffer *buffer = buffer_cache_find(&key);
+	if (buffer) {
+		goto unlock;
 	}
 
 	if (!(buffer = calloc(1, sizeof *buffer))) {
 		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
-		return NULL;
+		goto unlock;
 	} else if (!mmap_color_buffer(buffer, state, color)) {
 		free(buffer);
-		return NULL;
+		buffer = NULL;
+		goto unlock;
 	}
 
 	buffer->background = color;
+	buffer->hash = key.hash;
 	buffer->ref_count = 1;
-	wl_list_insert(&state->colors, &buffer->link);
+	buffer_cache_insert(buffer);
+
+unlock:
+	pthread_mutex_unlock(&cache_lock);
 	return buffer;
 }
 
+/**
+ * Everything needed to composite one horizontal band of a buffer.
+ * Pixman images cache derived state when used, so each band wraps the
+ * source and destination pixels in images of its own.
+ */
+struct composite_job {
+	pixman_format_code_t source_format;
+	void *source_data;
+	int source_width, source_height, source_stride;
+	pixman_transform_t matrix;
+	pixman_repeat_t repeat;
+	pixman_filter_t filter;
+	const pixman_fixed_t *filter_params;
+	int n_filter_params;
+
+	// Set when the image is drawn at 1:1 scale and a whole pixel offset
+	bool blit;
+	int32_t offset_x, offset_y;
+	bool stream;
+
+	// Set when the image is shrunk by averaging
+	const struct downscale *downscale;
+
+	pixman_format_code_t format;
+	void *data;
+	int32_t width, height, stride;
+	int32_t band_height;
+	bool dither;
+
+	bool fill;
+	pixman_color_t color;
+
+	const atomic_bool *cancel;
+};
+
+static int32_t clamp(int32_t x, int32_t min, int32_t max) {
+	return x < min ? min : x > max ? max : x;
+}
+
+/**
+ * Draws a band of an unscaled image. Only the parts of the band the image
+ * leaves uncovered are filled with the background.
+ */
+static void blit_band(struct composite_job *job,
+		pixman_image_t *dest, pixman_image_t *source,
+		int32_t y, int32_t height) {
+	if (job->repeat == PIXMAN_REPEAT_NORMAL) {
+		blit_tile(dest, source, job->offset_x, job->offset_y + y, job->stream);
+		return;
+	}
+
+	int32_t x1 = clamp(-job->offset_x, 0, job->width);
+	int32_t x2 = clamp(job->source_width - job->offset_x, x1, job->width);
+	int32_t y1 = clamp(-job->offset_y - y, 0, height);
+	int32_t y2 = clamp(job->source_height - job->offset_y - y, y1, height);
+	if (x1 == x2 || y1 == y2) {
+		x1 = x2 = y1 = y2 = 0;
+	}
+
+	if (job->fill) {
+		pixman_box32_t boxes[] = {
+			{ 0, 0, job->width, y1 },
+			{ 0, y1, x1, y2 },
+			{ x2, y1, job->width, y2 },
+			{ 0, y2, job->width, height },
+		};
+		pixman_box32_t *end = boxes;
+		for (size_t i = 0; i < sizeof boxes / sizeof *boxes; ++i) {
+			if (boxes[i].x1 < boxes[i].x2 && boxes[i].y1 < boxes[i].y2) {
+				*end++ = boxes[i];
+			}
+		}
+		blit_fill(dest, &job->color, boxes, end - boxes, job->stream);
+	}
+
+	blit_copy(dest, x1, y1, source,
+			x1 + job->offset_x, y + y1 + job->offset_y,
+			x2 - x1, y2 - y1, job->stream);
+}
+
+static void composite_band(void *data, unsigned index) {
+	struct composite_job *job = data;
+	if (atomic_load(job->cancel)) {
+		return;
+	}
+	int32_t y = index * job->band_height;
+	int32_t height = job->height - y < job->band_height ?
+			job->height - y : job->band_height;
+
+	pixman_image_t *dest = pixman_image_create_bits_no_clear(
+			job->format, job->width, height,
+			(void *)((char *)job->data + y * job->stride), job->stride);
+	pixman_image_t *source = pixman_image_create_bits_no_clear(
+			job->source_format, job->source_width, job->source_height,
+			job->source_data, job->source_stride);
+	if (!dest || !source) {
+		wsbg_log(LOG_ERROR, "Creation of pixman image failed");
+		goto cleanup;
+	}
+
+	if (job->dither) {
+		// Keep the pattern continuous across bands
+		pixman_image_set_dither(dest, PIXMAN_DITHER_ORDERED_BAYER_8);
+		pixman_image_set_dither_offset(dest, 0, y);
+	}
+
+	if (job->blit) {
+		blit_band(job, dest, source, y, height);
+		goto cleanup;
+	} else if (job->downscale) {
+		downscale_band(job->downscale, dest, source, y);
+		goto cleanup;
+	}
+
+	if (job->fill) {
+		pixman_box32_t box = { .x2 = job->width, .y2 = height };
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, dest, &job->color, 1, &box);
+	}
+
+	pixman_image_set_filter(source, job->filter,
+			job->filter_params, job->n_filter_params);
+	pixman_image_set_transform(source, &job->matrix);
+	pixman_image_set_repeat(source, job->repeat);
+
+	// The band keeps the source coordinates of the full buffer,
+	// so every pixel comes out the same as in a single composite
+	pixman_image_composite32(
+		PIXMAN_OP_OVER, source, NULL, dest,
+		0, y, 0, 0, 0, 0, job->width, height);
+
+cleanup:
+	if (source) {
+		pixman_image_unref(source);
+	}
+	if (dest) {
+		pixman_image_unref(dest);
+	}
+}
+
+/**
+ * Splits `job` into bands for the workers, and waits for them.
+ */
+static void run_composite_job(struct wsbg_state *state,
+		struct composite_job *job) {
+	int64_t bands = (int64_t)job->width * job->height / BAND_PIXELS_MIN;
+	if (bands > wsbg_workers_count(state->workers)) {
+		bands = wsbg_workers_count(state->workers);
+	} else if (bands < 1) {
+		bands = 1;
+	}
+	job->band_height = (job->height + bands - 1) / bands;
+	bands = (job->height + job->band_height - 1) / job->band_height;
+
+	wsbg_workers_run(state->workers, composite_band, job, bands);
+}
+
+static void free_mipmap_data(pixman_image_t *image, void *data) {
+	free(data);
+}
+
+/**
+ * Returns `source` shrunk to half its size. Returns NULL on failure.
+ */
+static pixman_image_t *build_mipmap(struct wsbg_state *state,
+		pixman_image_t *source, const atomic_bool *cancel) {
+	int32_t width = pixman_image_get_width(source) / 2;
+	int32_t height = pixman_image_get_height(source) / 2;
+	void *data = malloc((size_t)width * height * 4);
+	pixman_image_t *mipmap = data ? pixman_image_create_bits_no_clear(
+			PIXMAN_x8r8g8b8, width, height, data, width * 4) : NULL;
+	if (!mipmap) {
+		wsbg_log(LOG_ERROR, "Memory allocation failed");
+		free(data);
+		return NULL;
+	}
+	pixman_image_set_destroy_function(mipmap, free_mipmap_data, data);
+
+	struct wsbg_image_transform transform = {
+		.scale_x = 2 * Q16,
+		.scale_y = 2 * Q16,
+	};
+	struct downscale downscale;
+	if (!downscale_init(&downscale, width, height, &transform,
+			pixman_image_get_width(source), pixman_image_get_height(source),
+			0)) {
+		pixman_image_unref(mipmap);
+		return NULL;
+	}
+
+	struct composite_job job = {
+		.source_format = pixman_image_get_format(source),
+		.source_data = pixman_image_get_data(source),
+		.source_width = pixman_image_get_width(source),
+		.source_height = pixman_image_get_height(source),
+		.source_stride = pixman_image_get_stride(source),
+		.downscale = &downscale,
+		.format = PIXMAN_x8r8g8b8,
+		.data = data,
+		.width = width,
+		.height = height,
+		.stride = width * 4,
+		.cancel = cancel,
+	};
+	run_composite_job(state, &job);
+	downscale_finish(&downscale);
+
+	if (atomic_load(cancel)) {
+		pixman_image_unref(mipmap);
+		return NULL;
+	}
+	return mipmap;
+}
+
+/**
+ * Returns the smallest mipmap of `image` which is still at least as large
+ * as `transform` needs, or the image itself, and adjusts `transform` to it.
+ * Missing mipmaps are built, as long as the sides of the image halve
+ * evenly, so that every mipmap lines up exactly with the image.
+ */
+static pixman_image_t *get_mipmap(struct wsbg_state *state,
+		struct wsbg_image *image,
+		struct wsbg_image_transform *transform,
+		const atomic_bool *cancel) {
+	pixman_image_t *surface = image->surface;
+	int level = 0;
+	for (; level < WSBG_MIPMAP_LEVELS &&
+			transform->scale_x >= 2 * Q16 &&
+			transform->scale_y >= 2 * Q16; ++level) {
+		if (!image->mipmaps[level]) {
+			int32_t width = pixman_image_get_width(surface);
+			int32_t height = pixman_image_get_height(surface);
+			if ((width & 1) || (height & 1) ||
+					width < 2 * MIPMAP_SIZE_MIN ||
+					height < 2 * MIPMAP_SIZE_MIN ||
+					!(image->mipmaps[level] =
+						build_mipmap(state, surface, cancel))) {
+				break;
+			}
+		}
+		surface = image->mipmaps[level];
+		transform->scale_x /= 2;
+		transform->scale_y /= 2;
+	}
+	return surface;
+}
+
+/**
+ * Gets the transform of a buffer holding the whole image, which the
+ * compositor crops and scales to the given size, and the part of it
+ * shown in `source`. Replaces the size with the size of that buffer.
+ * Returns false if the image doesn't cover the given size.
+ */
+static bool get_source_transform(
+		struct wsbg_image *image,
+		struct wsbg_config *config,
+		int32_t *width, int32_t *height,
+		struct wsbg_image_transform *transform,
+		struct wsbg_source *source) {
+	switch (config->mode) {
+	case BACKGROUND_MODE_STRETCH:
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_FIT:
+	case BACKGROUND_MODE_CENTER:
+		break;
+	default:
+		return false;
+	}
+	if (image->is_scalable) {
+		return false;
+	}
+
+	struct wsbg_image_transform view;
+	bool covered;
+	get_wsbg_image_transform(
+			image, config->mode, config->position, *width, *height,
+			&view, &covered);
+
+	// Shown part of the image in Q16 image pixels, allowing for a pixel
+	// of rounding error at the edges
+	int64_t image_width = image->width * Q16;
+	int64_t image_height = image->height * Q16;
+	int64_t x = view.x * view.scale_x / Q16;
+	int64_t y = view.y * view.scale_y / Q16;
+	int64_t x2 = x + *width * (int64_t)view.scale_x;
+	int64_t y2 = y + *height * (int64_t)view.scale_y;
+	if (x < -Q16 || y < -Q16 ||
+			image_width + Q16 < x2 || image_height + Q16 < y2) {
+		return false;
+	}
+	x = x < 0 ? 0 : x;
+	y = y < 0 ? 0 : y;
+	x2 = x2 > image_width ? image_width : x2;
+	y2 = y2 > image_height ? image_height : y2;
+
+	int32_t buffer_width = image->width, buffer_height = image->height;
+	int32_t longest = image->width > image->height ?
+			image->width : image->height;
+	if (longest > SOURCE_SIZE_MAX) {
+		buffer_width = rounded_div(
+				(int64_t)image->width * SOURCE_SIZE_MAX, longest);
+		buffer_height = rounded_div(
+				(int64_t)image->height * SOURCE_SIZE_MAX, longest);
+	}
+
+	*transform = (struct wsbg_image_transform){
+		.scale_x = rounded_div(image->width * Q16, buffer_width),
+		.scale_y = rounded_div(image->height * Q16, buffer_height),
+	};
+
+	// From Q16 image pixels to wl_fixed_t buffer pixels
+	source->x = rounded_div(x * buffer_width, image->width * 256);
+	source->y = rounded_div(y * buffer_height, image->height * 256);
+	source->width = rounded_div(x2 * buffer_width, image->width * 256)
+			- source->x;
+	source->height = rounded_div(y2 * buffer_height, image->height * 256)
+			- source->y;
+
+	*width = buffer_width;
+	*height = buffer_height;
+	return source->width > 0 && source->height > 0;
+}
+
+/**
+ * Shrinks a buffer of `width`x`height` pixels to the part the image covers,
+ * widened to whole surface coordinates, and moves the transform along.
+ * Sets `box` to that part of the surface. Leaves everything unchanged if
+ * the image covers all of the surface, or none of it.
+ */
+static void get_letterbox(
+		struct wsbg_image *image,
+		int32_t *width, int32_t *height,
+		int32_t surface_width, int32_t surface_height,
+		struct wsbg_image_transform *transform,
+		struct wsbg_box *box) {
+	// Image in Q16 buffer pixels, clipped to the buffer
+	int64_t buffer_width = *width * Q16, buffer_height = *height * Q16;
+	int64_t x1 = -transform->x, y1 = -transform->y;
+	int64_t x2 = x1 + rounded_div(image->width * Q16 * Q16, transform->scale_x);
+	int64_t y2 = y1 + rounded_div(image->height * Q16 * Q16, transform->scale_y);
+	x1 = x1 < 0 ? 0 : x1;
+	y1 = y1 < 0 ? 0 : y1;
+	x2 = x2 > buffer_width ? buffer_width : x2;
+	y2 = y2 > buffer_height ? buffer_height : y2;
+	if (x2 <= x1 || y2 <= y1) {
+		return;
+	}
+
+	// Subsurfaces are placed and sized in whole surface coordinates
+	int64_t surface_x1 = x1 * surface_width / buffer_width;
+	int64_t surface_y1 = y1 * surface_height / buffer_height;
+	int64_t surface_x2 =
+		(x2 * surface_width + buffer_width - 1) / buffer_width;
+	int64_t surface_y2 =
+		(y2 * surface_height + buffer_height - 1) / buffer_height;
+	if (surface_x1 == 0 && surface_y1 == 0 &&
+			surface_x2 == surface_width && surface_y2 == surface_height) {
+		return;
+	}
+
+	int32_t buffer_x1 = rounded_div(surface_x1 * *width, surface_width);
+	int32_t buffer_y1 = rounded_div(surface_y1 * *height, surface_height);
+	int32_t buffer_x2 = rounded_div(surface_x2 * *width, surface_width);
+	int32_t buffer_y2 = rounded_div(surface_y2 * *height, surface_height);
+
+	transform->x += buffer_x1 * Q16;
+	transform->y += buffer_y1 * Q16;
+	*width = buffer_x2 - buffer_x1;
+	*height = buffer_y2 - buffer_y1;
+	*box = (struct wsbg_box){
+		.x = surface_x1,
+		.y = surface_y1,
+		.width = surface_x2 - surface_x1,
+		.height = surface_y2 - surface_y1,
+	};
+}
+
+bool load_wsbg_image(struct wsbg_state *state, struct wsbg_image *image,
+		struct wsbg_color background, int scaled_width, int scaled_height) {
+	struct wsbg_disk_cache *cache = state->disk_cache;
+	// Scalable images are decoded at each size, which isn't worth keeping
+	if (cache && !image->surface && image->width >= 0 && !image->is_scalable &&
+			(wsbg_disk_cache_load_image(cache, image, (struct wsbg_color){}) ||
+				wsbg_disk_cache_load_image(cache, image, background))) {
+		return true;
+	}
+	if (!load_image(image, background, scaled_width, scaled_height)) {
+		return false;
+	}
+	// Decoded images are stored in the disk cache, and then mapped from it,
+	// which leaves their pixels to the page cache
+	// Reduced images are only stored at full size
+	if (cache && image->surface && !image->is_mapped && !image->is_scalable &&
+			pixman_image_get_width(image->surface) == image->width &&
+			pixman_image_get_height(image->surface) == image->height &&
+			wsbg_disk_cache_store_image(cache, image)) {
+		struct wsbg_color stored = image->background;
+		unload_image(image);
+		if (!wsbg_disk_cache_load_image(cache, image, stored)) {
+			return load_image(image, background, scaled_width, scaled_height);
+		}
+	}
+	return true;
+}
+
+/**
+ * Gets the reduced size `image` is decoded at, which still covers its size
+ * scaled by `transform`.
+ */
+static void get_reduced_size(struct wsbg_image *image,
+		const struct wsbg_image_transform *transform,
+		int *scaled_width, int *scaled_height) {
+	int64_t width_q16 = image->width * Q16;
+	int64_t height_q16 = image->height * Q16;
+	*scaled_width = (width_q16 + transform->scale_x - 1) / transform->scale_x;
+	*scaled_height =
+		(height_q16 + transform->scale_y - 1) / transform->scale_y;
+	*scaled_width = *scaled_width < image->width ?
+		*scaled_width : image->width;
+	*scaled_height = *scaled_height < image->height ?
+		*scaled_height : image->height;
+}
+
+void get_wsbg_reduced_size(struct wsbg_state *state,
+		struct wsbg_image *image,
+		enum background_mode mode, struct wsbg_size position,
+		int32_t width, int32_t height,
+		int *scaled_width, int *scaled_height) {
+	*scaled_width = image->width;
+	*scaled_height = image->height;
+	// Buffers the compositor scales may hold the whole image
+	if (state->compositor_scaling || width <= 0 || height <= 0 ||
+			mode == BACKGROUND_MODE_SOLID_COLOR) {
+		return;
+	}
+	struct wsbg_image_transform transform;
+	bool covered;
+	get_wsbg_image_transform(image, mode, position, width, height,
+			&transform, &covered);
+	get_reduced_size(image, &transform, scaled_width, scaled_height);
+}
+
+/**
+ * Makes sure `image` is loaded like load_image, and counts it as used for
+ * evicting decoded images.
+ */
+static bool load_source(struct wsbg_state *state, struct wsbg_image *image,
+		struct wsbg_color background, int scaled_width, int scaled_height) {
+	image->last_used = ++state->image_use_count;
+	if (is_image_loaded(image, background, scaled_width, scaled_height)) {
+		++state->image_hits;
+		return true;
+	}
+	if (!load_wsbg_image(state, image, background,
+			scaled_width, scaled_height)) {
+		return false;
+	}
+	if (image->surface) {
+		++state->image_loads;
+		wsbg_log(LOG_DEBUG, "Loaded image %s (%u loads, %u hits, "
+				"%u evictions)", image->path, state->image_loads,
+				state->image_hits, state->image_evictions);
+	}
+	return true;
+}
+
+/**
+ * Fills in the key of `buffer` from `key`, and adds it to the cache.
+ */
+static void insert_buffer(struct wsbg_buffer *buffer,
+		const struct wsbg_buffer *key) {
+	buffer->image = key->image;
+	buffer->width = key->width;
+	buffer->height = key->height;
+	buffer->format = key->format;
+	buffer->background = key->background;
+	buffer->transform = key->transform;
+	buffer->repeat = key->repeat;
+	buffer->filter = key->filter;
+	buffer->rotation = key->rotation;
+	buffer->hash = key->hash;
+
+	buffer->ref_count = 1;
+	pthread_mutex_lock(&cache_lock);
+	buffer_cache_insert(buffer);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Returns a buffer of the file the disk cache has of `key`, if any.
+ */
+static struct wsbg_buffer *load_cached_buffer(struct wsbg_state *state,
+		const struct wsbg_buffer *key) {
+	struct wsbg_buffer *buffer = calloc(1, sizeof *buffer);
+	if (!buffer) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	if (!(buffer->block = wsbg_disk_cache_load(state->disk_cache,
+			state->pools, key, &buffer->buffer, &buffer->size))) {
+		free(buffer);
+		return NULL;
+	}
+	atomic_fetch_add(&buffer_memory, buffer->size);
+	insert_buffer(buffer, key);
+	return buffer;
+}
+
+/**
+ * Returns whether `transform` draws all of `image` at 1:1 scale and a whole
+ * pixel offset into a buffer of `width`x`height` pixels.
+ */
+static bool is_drawn_whole(const struct wsbg_image *image,
+		const struct wsbg_image_transform *transform,
+		int32_t width, int32_t height) {
+	if (transform->scale_x != Q16 || transform->scale_y != Q16 ||
+			(transform->x & (Q16 - 1)) || (transform->y & (Q16 - 1))) {
+		return false;
+	}
+	int32_t x = -transform->x / Q16;
+	int32_t y = -transform->y / Q16;
+	return x >= 0 && y >= 0 &&
+		width - x >= image->width && height - y >= image->height;
+}
+
+bool is_wsbg_image_decoded_directly(struct wsbg_state *state,
+		struct wsbg_image *image,
+		enum background_mode mode, struct wsbg_size position,
+		int32_t width, int32_t height) {
+	// Mirrors the checks of get_wsbg_buffer and decode_buffer
+	if (state->compositor_scaling || state->format != WL_SHM_FORMAT_XRGB8888 ||
+			width <= 0 || height <= 0 ||
+			mode == BACKGROUND_MODE_SOLID_COLOR ||
+			image->is_scalable || image->width <= 0 ||
+			image->background.a) {
+		return false;
+	}
+	struct wsbg_image_transform transform;
+	bool covered;
+	get_wsbg_image_transform(image, mode, position, width, height,
+			&transform, &covered);
+	if (mode == BACKGROUND_MODE_TILE && !covered) {
+		return false;
+	}
+	return is_drawn_whole(image, &transform, width, height);
+}
+
+/**
+ * Decodes the image of `key` straight into a new buffer, when it's drawn
+ * unscaled and whole, which saves decoding it into memory of its own and
+ * copying it. Returns NULL if it can't be, so that it's drawn as usual.
+ */
+static struct wsbg_buffer *decode_buffer(struct wsbg_state *state,
+		const struct wsbg_buffer *key) {
+	struct wsbg_image *image = key->image;
+	if (key->format != WL_SHM_FORMAT_XRGB8888 || key->repeat ||
+			image->surface || image->is_scalable || image->width <= 0 ||
+			!is_drawn_whole(image, &key->transform,
+				key->width, key->height)) {
+		return NULL;
+	}
+	int32_t x = -key->transform.x / Q16;
+	int32_t y = -key->transform.y / Q16;
+
+	struct wsbg_buffer *buffer = calloc(1, sizeof *buffer);
+	if (!buffer) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	int32_t stride = key->width * 4;
+	if (!mmap_buffer(buffer, state, key->width, key->height, stride)) {
+		free(buffer);
+		return NULL;
+	}
+
+	uint8_t *data = wsbg_shm_block_data(buffer->block);
+	if (key->background.a) {
+		pixman_image_t *dest = pixman_image_create_bits_no_clear(
+				find_pixel_format(key->format)->pixman_format,
+				key->width, key->height, (uint32_t *)data, stride);
+		if (!dest) {
+			wsbg_log(LOG_ERROR, "Creation of pixman image failed");
+			goto error;
+		}
+		pixman_color_t color = {
+			.red   = key->background.r * UINT16_C(0x0101),
+			.green = key->background.g * UINT16_C(0x0101),
+			.blue  = key->background.b * UINT16_C(0x0101),
+			.alpha = key->background.a * UINT16_C(0x0101)
+		};
+		pixman_box32_t box = { .x2 = key->width, .y2 = key->height };
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, dest, &color, 1, &box);
+		pixman_image_unref(dest);
+	}
+
+	if (!decode_image(image, data + (size_t)y * stride + x * 4, stride)) {
+		goto error;
+	}
+	wsbg_log(LOG_DEBUG, "Decoded image %s into a buffer", image->path);
+	return buffer;
+
+error:
+	munmap_buffer(buffer);
+	free(buffer);
+	return NULL;
+}
+
 struct wsbg_buffer *get_wsbg_buffer(
 		struct wsbg_config *config,
 		struct wsbg_state *state,
-		int32_t width, int32_t height) {
+		int32_t width, int32_t height,
+		int32_t surface_width, int32_t surface_height,
+		struct wsbg_source *source,
+		struct wsbg_box *box,
+		bool progressive, bool *refine,
+		const atomic_bool *cancel) {
 	struct wsbg_image *image = config->image;
+	*source = (struct wsbg_source){0};
+	*box = (struct wsbg_box){0};
+	*refine = false;
 
 	if (!image || config->mode == BACKGROUND_MODE_SOLID_COLOR) {
 		return get_wsbg_color_buffer(state, config->color);
 	}
 
-	if (image->width <= 0 && !load_image(image, config->color, 0, 0)) {
-		return NULL;
+	// Decoded ahead at startup, maybe still
+	wsbg_preloader_claim(state->preloader, image);
+
+	// The disk cache knows the size of images it has buffers of, so that
+	// those aren't decoded at all
+	bool opaque;
+	if (image->width == 0 && state->disk_cache &&
+			wsbg_disk_cache_load_info(state->disk_cache, image, &opaque)) {
+		image->background = opaque ? (struct wsbg_color){} : config->color;
+	} else if (image->width <= 0) {
+		if (!load_source(state, image, config->color, 0, 0)) {
+			return NULL;
+		}
+		if (state->disk_cache) {
+			wsbg_disk_cache_store_info(state->disk_cache, image);
+		}
 	}
 
 	struct wsbg_image_transform transform;
-	bool covered;
-	get_wsbg_image_transform(
-			image, config->mode, config->position, width, height,
-			&transform, &covered);
+	bool covered = true;
+	if (!state->compositor_scaling || !get_source_transform(
+			image, config, &width, &height, &transform, source)) {
+		*source = (struct wsbg_source){0};
+		get_wsbg_image_transform(
+				image, config->mode, config->position, width, height,
+				&transform, &covered);
+	}
+
+	// The rest of the output is left to a buffer of the background color
+	if (!covered && state->subcompositor &&
+			surface_width > 0 && surface_height > 0 &&
+			(config->mode == BACKGROUND_MODE_FIT ||
+				config->mode == BACKGROUND_MODE_CENTER)) {
+		get_letterbox(image, &width, &height,
+				surface_width, surface_height, &transform, box);
+	}
 
 	struct wsbg_color background = (!covered || image->background.a) ?
 			config->color : (struct wsbg_color){};
 	bool repeat = (config->mode == BACKGROUND_MODE_TILE) && !covered;
 
-	struct wsbg_buffer *buffer;
-	wl_list_for_each(buffer, &image->buffers, link) {
-		if (transform_eql(buffer->transform, transform) &&
-				color_eql(buffer->background, background) &&
-				buffer->repeat == repeat) {
-			++buffer->ref_count;
-			return buffer;
+	// Scalable images are loaded at the scaled size, so they're never
+	// scaled here. At 1:1 scale and whole pixel offsets, every filter
+	// gives the same result.
+	bool unscaled = (image->is_scalable ||
+				(transform.scale_x == Q16 && transform.scale_y == Q16)) &&
+			!(transform.x & (Q16 - 1)) && !(transform.y & (Q16 - 1));
+
+	struct wsbg_buffer key = {
+		.image = image,
+		.width = width,
+		.height = height,
+		.format = state->format,
+		.transform = transform,
+		.background = background,
+		.repeat = repeat,
+		.filter = unscaled ? WSBG_FILTER_FAST : config->filter,
+	};
+	pthread_mutex_lock(&cache_lock);
+	struct wsbg_buffer *buffer = buffer_cache_find(&key);
+	pthread_mutex_unlock(&cache_lock);
+	if (!buffer && state->disk_cache) {
+		buffer = load_cached_buffer(state, &key);
+	}
+	if (!buffer && progressive && key.filter != WSBG_FILTER_FAST) {
+		key.filter = WSBG_FILTER_FAST;
+		*refine = true;
+		pthread_mutex_lock(&cache_lock);
+		buffer = buffer_cache_find(&key);
+		pthread_mutex_unlock(&cache_lock);
+	}
+	if (buffer) {
+		return buffer;
+	}
+
+	if (unscaled && (buffer = decode_buffer(state, &key))) {
+		if (atomic_load(cancel)) {
+			munmap_buffer(buffer);
+			free(buffer);
+			return NULL;
+		}
+		if (state->disk_cache) {
+			wsbg_disk_cache_store(state->disk_cache, &key,
+					wsbg_shm_block_data(buffer->block), key.width * 4);
 		}
+		insert_buffer(buffer, &key);
+		return buffer;
 	}
 
 	int scaled_width = 0, scaled_height = 0;
 	if (image->is_scalable) {
 		scaled_width = rounded_div(image->width * Q16, transform.scale_x);
 		scaled_height = rounded_div(image->height * Q16, transform.scale_y);
+	} else if (image->is_reducible) {
+		get_reduced_size(image, &transform, &scaled_width, &scaled_height);
 	}
 
-	if (!load_image(image, config->color, scaled_width, scaled_height)) {
+	if (!load_source(state, image, config->color,
+				scaled_width, scaled_height) ||
+			atomic_load(cancel)) {
 		return NULL;
-	} else if (!(buffer = calloc(1, sizeof *buffer))) {
+	}
+
+	// Shrinking starts from the closest mipmap, so that rendering an image
+	// at several sizes costs little more than shrinking it once
+	struct wsbg_image_transform source_transform = transform;
+	pixman_image_t *surface = image->surface;
+	// Reduced images are scaled from their decoded size
+	int32_t decoded_width = pixman_image_get_width(surface);
+	int32_t decoded_height = pixman_image_get_height(surface);
+	if (!image->is_scalable && decoded_width != image->width) {
+		source_transform.scale_x = (int64_t)source_transform.scale_x *
+			decoded_width / image->width;
+	}
+	if (!image->is_scalable && decoded_height != image->height) {
+		source_transform.scale_y = (int64_t)source_transform.scale_y *
+			decoded_height / image->height;
+	}
+	if (!unscaled && !image->is_scalable) {
+		surface = get_mipmap(state, image, &source_transform, cancel);
+		if (atomic_load(cancel)) {
+			return NULL;
+		}
+	}
+
+	struct filter_kernel *kernel = NULL;
+	if (key.filter == WSBG_FILTER_LANCZOS && !(kernel = get_filter_kernel(
+			source_transform.scale_x, source_transform.scale_y))) {
+		return NULL;
+	}
+
+	if (!(buffer = calloc(1, sizeof *buffer))) {
 		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
 		return NULL;
 	}
 
-	pixman_image_t *surface;
-	if (!mmap_buffer(buffer, state, width, height, &surface)) {
+	// Pixman rows are made of whole 32-bit words
+	const struct pixel_format *format = find_pixel_format(state->format);
+	int32_t stride = (width * format->bytes + 3) & ~3;
+	if (!mmap_buffer(buffer, state, width, height, stride)) {
 		free(buffer);
 		return NULL;
 	}
 
-	if (background.a) {
-		pixman_color_t fill = {
+	struct composite_job job = {
+		.source_format = pixman_image_get_format(surface),
+		.source_data = pixman_image_get_data(surface),
+		.source_width = pixman_image_get_width(surface),
+		.source_height = pixman_image_get_height(surface),
+		.source_stride = pixman_image_get_stride(surface),
+		.repeat = repeat ? PIXMAN_REPEAT_NORMAL : PIXMAN_REPEAT_NONE,
+		.filter = key.filter == WSBG_FILTER_FAST ? PIXMAN_FILTER_FAST :
+			key.filter == WSBG_FILTER_GOOD ? PIXMAN_FILTER_GOOD :
+			kernel ? PIXMAN_FILTER_SEPARABLE_CONVOLUTION :
+			PIXMAN_FILTER_BEST,
+		.filter_params = kernel ? kernel->params : NULL,
+		.n_filter_params = kernel ? kernel->n_params : 0,
+		.format = format->pixman_format,
+		.data = wsbg_shm_block_data(buffer->block),
+		.width = width,
+		.height = height,
+		.stride = stride,
+		.dither = format->dither,
+		.fill = background.a != 0,
+		.color = {
 			.red   = background.r * UINT16_C(0x0101),
 			.green = background.g * UINT16_C(0x0101),
 			.blue  = background.b * UINT16_C(0x0101),
 			.alpha = background.a * UINT16_C(0x0101)
-		};
+		},
+		.cancel = cancel,
+	};
 
-		pixman_box32_t box = { .x2 = width, .y2 = height };
-		pixman_image_fill_boxes(PIXMAN_OP_SRC, surface, &fill, 1, &box);
+	// Unscaled images need neither filtering nor blending, as decoded
+	// images are opaque
+	if (unscaled && !job.dither) {
+		job.blit = true;
+		job.offset_x = transform.x / Q16;
+		job.offset_y = transform.y / Q16;
+		job.stream = (size_t)height * stride >= STREAM_SIZE_MIN;
+	}
+
+	// Shrinking averages all pixels covered by each buffer pixel, which
+	// doesn't alias like the interpolating pixman filters
+	struct downscale downscale;
+	if (!unscaled && !repeat && !image->is_scalable &&
+			(key.filter == WSBG_FILTER_GOOD ||
+				key.filter == WSBG_FILTER_BEST) &&
+			source_transform.scale_x >= Q16 &&
+			source_transform.scale_y >= Q16 &&
+			downscale_init(&downscale, width, height, &source_transform,
+				job.source_width, job.source_height,
+				UINT32_C(0xFF000000) |
+				(uint32_t)config->color.r << 16 |
+				(uint32_t)config->color.g << 8 | config->color.b)) {
+		job.downscale = &downscale;
 	}
 
-	pixman_transform_t matrix;
 	pixman_transform_init_translate(
-			&matrix, transform.x, transform.y);
+			&job.matrix, source_transform.x, source_transform.y);
 	if (!image->is_scalable) {
-		pixman_transform_scale(
-				&matrix, NULL, transform.scale_x, transform.scale_y);
+		pixman_transform_scale(&job.matrix, NULL,
+				source_transform.scale_x, source_transform.scale_y);
 	}
 
-	pixman_image_set_filter(image->surface, PIXMAN_FILTER_BEST, NULL, 0);
-	pixman_image_set_transform(image->surface, &matrix);
-	pixman_image_set_repeat(image->surface,
-			repeat ? PIXMAN_REPEAT_NORMAL : PIXMAN_REPEAT_NONE);
+	run_composite_job(state, &job);
+	if (job.downscale) {
+		downscale_finish(&downscale);
+	}
 
-	pixman_image_composite32(
-		PIXMAN_OP_OVER, image->surface, NULL, surface,
-		0, 0, 0, 0, 0, 0, width, height);
+	if (atomic_load(cancel)) {
+		munmap_buffer(buffer);
+		free(buffer);
+		return NULL;
+	}
+
+	if (state->disk_cache && !*refine) {
+		wsbg_disk_cache_store(state->disk_cache, &key,
+				wsbg_shm_block_data(buffer->block), stride);
+	}
+	insert_buffer(buffer, &key);
+	return buffer;
+}
 
-	pixman_image_unref(surface);
+struct wsbg_buffer *get_wsbg_rotated_buffer(struct wsbg_state *state,
+		struct wsbg_buffer *upright, uint32_t rotation) {
+	// Color buffers look the same either way
+	if (!upright->image || !upright->block) {
+		return upright;
+	}
 
-	buffer->background = background;
-	buffer->transform = transform;
-	buffer->repeat = repeat;
+	// Buffers turned the other way are shared, as the compositor turns
+	// them around
+	struct wsbg_buffer key = *upright;
+	key.rotation = rotation;
+	pthread_mutex_lock(&cache_lock);
+	struct wsbg_buffer *buffer = buffer_cache_find(&key);
+	if (!buffer) {
+		struct wsbg_buffer other = key;
+		other.rotation ^= WL_OUTPUT_TRANSFORM_180;
+		buffer = buffer_cache_find(&other);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (buffer) {
+		release_wsbg_buffer(upright);
+		return buffer;
+	}
 
-	buffer->ref_count = 1;
-	wl_list_insert(&image->buffers, &buffer->link);
+	if (!(buffer = calloc(1, sizeof *buffer))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return upright;
+	}
+	const struct pixel_format *format = find_pixel_format(upright->format);
+	int32_t stride = (upright->height * format->bytes + 3) & ~3;
+	if (!mmap_buffer(buffer, state, upright->height, upright->width, stride)) {
+		free(buffer);
+		return upright;
+	}
+
+	// Fetched after allocating, which may move the pool of `upright`
+	pixman_image_t *source = pixman_image_create_bits_no_clear(
+			format->pixman_format, upright->width, upright->height,
+			wsbg_shm_block_data(upright->block),
+			upright->size / upright->height);
+	pixman_image_t *dest = pixman_image_create_bits_no_clear(
+			format->pixman_format, upright->height, upright->width,
+			wsbg_shm_block_data(buffer->block), stride);
+	if (!source || !dest) {
+		wsbg_log(LOG_ERROR, "Creation of pixman image failed");
+		if (source) {
+			pixman_image_unref(source);
+		}
+		if (dest) {
+			pixman_image_unref(dest);
+		}
+		munmap_buffer(buffer);
+		free(buffer);
+		return upright;
+	}
+
+	// Maps the buffer to the surface like the compositor does with the
+	// buffer transform: pixel centers land on pixel centers, so nearest
+	// sampling copies pixels exactly
+	pixman_transform_t transform = {{
+		{ 0, pixman_fixed_1, 0 },
+		{ -pixman_fixed_1, 0, pixman_int_to_fixed(upright->height) },
+		{ 0, 0, pixman_fixed_1 },
+	}};
+	if (rotation == WL_OUTPUT_TRANSFORM_270) {
+		transform = (pixman_transform_t){{
+			{ 0, -pixman_fixed_1, pixman_int_to_fixed(upright->width) },
+			{ pixman_fixed_1, 0, 0 },
+			{ 0, 0, pixman_fixed_1 },
+		}};
+	}
+	pixman_image_set_transform(source, &transform);
+	pixman_image_set_filter(source, PIXMAN_FILTER_NEAREST, NULL, 0);
+	pixman_image_composite32(PIXMAN_OP_SRC, source, NULL, dest,
+			0, 0, 0, 0, 0, 0, upright->height, upright->width);
+	pixman_image_unref(source);
+	pixman_image_unref(dest);
+
+	insert_buffer(buffer, &key);
+	release_wsbg_buffer(upright);
 	return buffer;
 }
 
+void forget_wsbg_image_buffers(struct wsbg_image *image) {
+	pthread_mutex_lock(&cache_lock);
+	buffer_cache_forget(image);
+	pthread_mutex_unlock(&cache_lock);
+}
+
 void release_wsbg_buffer(struct wsbg_buffer *buffer) {
-	if (!buffer || --buffer->ref_count != 0) {
+	if (!buffer) {
 		return;
 	}
+	pthread_mutex_lock(&cache_lock);
+	bool unused = --buffer->ref_count == 0;
+	if (unused) {
+		buffer_cache_remove(buffer);
+	}
+	pthread_mutex_unlock(&cache_lock);
 
-	wl_list_remove(&buffer->link);
-	munmap_buffer(buffer);
-	free(buffer);
+	if (unused) {
+		munmap_buffer(buffer);
+		free(buffer);
+	}
+}
+
+size_t get_wsbg_buffer_memory(void) {
+	return atomic_load(&buffer_memory);
 }
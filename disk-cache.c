@@ -0,0 +1,624 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "disk-cache.h"
+#include "image.h"
+#include "log.h"
+#include "shm.h"
+
+#define DISK_CACHE_VERSION 2
+
+// Pixels start on a page of their own, after the header and image path
+#define DATA_OFFSET 4096
+
+// Part of the limit trimming frees, so that the next stores don't trim again
+#define TRIM_SLACK_DIV 8
+
+/**
+ * Identifies the image file a cache file was made from. Files whose image
+ * has changed since are stale, and left to be removed.
+ */
+struct disk_source {
+	char magic[8];
+	uint32_t version;
+	uint32_t path_length;  // of the image path following the header
+	int64_t mtime_sec, mtime_nsec;
+	uint64_t file_size;
+};
+
+// What's known about an image before it's decoded
+struct disk_info {
+	struct disk_source source;
+	int32_t width, height;
+	uint8_t is_scalable, is_reducible, opaque;
+};
+
+/**
+ * Decoded pixels, which make a raw image file of their own. The background
+ * is what transparent images were blended with, or 0 for opaque ones.
+ */
+struct disk_image {
+	struct wsbg_raw_header raw;
+	struct disk_source source;
+	uint8_t background[4];
+};
+
+// Everything else a rendered buffer depends on
+struct disk_header {
+	struct disk_source source;
+	int32_t width, height, stride;
+	uint32_t format;
+	int32_t x, y, scale_x, scale_y;
+	uint8_t background[4];
+	uint8_t repeat, filter;
+};
+
+struct wsbg_disk_cache {
+	char *dir;
+	size_t max_size;
+	// Of all files, as found by the last trim plus what was stored since.
+	// Files replaced or removed by others are still counted until then.
+	atomic_size_t size;
+};
+
+static void trim(struct wsbg_disk_cache *cache);
+
+struct wsbg_disk_cache *wsbg_disk_cache_create(size_t max_size) {
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *suffix = "/wsbg";
+	if (!cache_home || cache_home[0] != '/') {
+		if (!(cache_home = getenv("HOME"))) {
+			wsbg_log(LOG_ERROR, "Unable to find cache directory");
+			return NULL;
+		}
+		suffix = "/.cache/wsbg";
+	}
+
+	struct wsbg_disk_cache *cache = calloc(1, sizeof *cache);
+	size_t length = strlen(cache_home) + strlen(suffix) + 1;
+	if (!cache || !(cache->dir = malloc(length))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		free(cache);
+		return NULL;
+	}
+	cache->max_size = max_size;
+	snprintf(cache->dir, length, "%s%s", cache_home, suffix);
+
+	// Create every missing parent, like mkdir -p
+	for (char *slash = strchr(cache->dir + 1, '/'); ;
+			slash = strchr(slash + 1, '/')) {
+		if (slash) {
+			*slash = '\0';
+		}
+		int ret = mkdir(cache->dir, 0700);
+		if (slash) {
+			*slash = '/';
+		}
+		if (ret == -1 && errno != EEXIST) {
+			wsbg_log_errno(LOG_ERROR, "Unable to create %s", cache->dir);
+			wsbg_disk_cache_destroy(cache);
+			return NULL;
+		}
+		if (!slash) {
+			break;
+		}
+	}
+
+	// Counts what's there, so that stores only look again beyond the limit
+	trim(cache);
+	return cache;
+}
+
+void wsbg_disk_cache_destroy(struct wsbg_disk_cache *cache) {
+	if (!cache) {
+		return;
+	}
+	free(cache->dir);
+	free(cache);
+}
+
+/**
+ * Fills in `source` for the current state of the image file. Returns false
+ * if it can't be found, or its path doesn't fit in the first page.
+ */
+static bool get_source(const char *magic, const char *path,
+		struct disk_source *source) {
+	struct stat st;
+	size_t path_length = strlen(path);
+	if (stat(path, &st) == -1 ||
+			path_length > DATA_OFFSET - sizeof(struct disk_header)) {
+		return false;
+	}
+	memcpy(source->magic, magic, sizeof source->magic);
+	source->version = DISK_CACHE_VERSION;
+	source->path_length = path_length;
+	source->mtime_sec = st.st_mtim.tv_sec;
+	source->mtime_nsec = st.st_mtim.tv_nsec;
+	source->file_size = st.st_size;
+	return true;
+}
+
+/**
+ * Returns the path of the file with `header`, named after a hash of it and
+ * the image path, which must be freed.
+ */
+static char *get_file_path(struct wsbg_disk_cache *cache,
+		const void *header, size_t size, const char *image_path,
+		const char *suffix) {
+	// FNV-1a over the header and the image path
+	uint64_t hash = UINT64_C(14695981039346656037);
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ ((const uint8_t *)header)[i]) * UINT64_C(1099511628211);
+	}
+	for (const char *c = image_path; *c; ++c) {
+		hash = (hash ^ (uint8_t)*c) * UINT64_C(1099511628211);
+	}
+
+	size_t length = strlen(cache->dir) + 1 + 16 + strlen(suffix) + 1;
+	char *path = malloc(length);
+	if (!path) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	snprintf(path, length, "%s/%016llx%s",
+			cache->dir, (unsigned long long)hash, suffix);
+	return path;
+}
+
+static bool read_all(int fd, void *data, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t n = pread(fd, data, size, offset);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data = (char *)data + n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data = (const char *)data + n;
+		size -= n;
+	}
+	return true;
+}
+
+/**
+ * Opens the file at `path`, and reads its header of `size` bytes into
+ * `header`. Returns -1 unless the file exists and was made from the same
+ * image file as `expected`, found `source_offset` bytes into the header.
+ * Touches the file, as loading it counts as a use for eviction.
+ */
+static int open_file(const char *path, const struct disk_source *expected,
+		const char *image_path, void *header, size_t size,
+		size_t source_offset) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	char stored_path[DATA_OFFSET];
+	const struct disk_source *source =
+		(const struct disk_source *)((const uint8_t *)header + source_offset);
+	if (!read_all(fd, header, size, 0) ||
+			memcmp(source, expected, sizeof *source) != 0 ||
+			!read_all(fd, stored_path, source->path_length, size) ||
+			memcmp(stored_path, image_path, source->path_length) != 0) {
+		close(fd);
+		return -1;
+	}
+	futimens(fd, NULL);
+	return fd;
+}
+
+/**
+ * Creates a temporary file to be renamed to `path` once written, so that
+ * readers only ever see whole files. Returns -1 on failure.
+ */
+static int create_file(const char *path, char **tmp_path) {
+	size_t length = strlen(path) + sizeof ".XXXXXX";
+	if (!(*tmp_path = malloc(length))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return -1;
+	}
+	snprintf(*tmp_path, length, "%s.XXXXXX", path);
+	int fd = mkstemp(*tmp_path);
+	if (fd == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to create %s", *tmp_path);
+		free(*tmp_path);
+		*tmp_path = NULL;
+	}
+	return fd;
+}
+
+/**
+ * Closes `fd`, and renames it to `path` if `written`, or removes it.
+ */
+static bool finish_file(int fd, char *tmp_path, const char *path,
+		bool written) {
+	if (close(fd) == -1 || !written || rename(tmp_path, path) == -1) {
+		if (written) {
+			wsbg_log_errno(LOG_ERROR, "Unable to write %s", path);
+		}
+		unlink(tmp_path);
+		written = false;
+	}
+	free(tmp_path);
+	return written;
+}
+
+/**
+ * Writes `header` of `size` bytes, followed by the image path, padded to
+ * `offset` bytes if it isn't 0.
+ */
+static bool write_header(int fd, const void *header, size_t size,
+		const char *image_path, size_t offset) {
+	char first_page[DATA_OFFSET] = {0};
+	size_t path_length = strlen(image_path);
+	memcpy(first_page, header, size);
+	memcpy(first_page + size, image_path, path_length);
+	return write_all(fd, first_page, offset ? offset : size + path_length);
+}
+
+struct cache_file {
+	char *name;
+	off_t size;
+	struct timespec mtime;
+};
+
+static int compare_mtime(const void *a, const void *b) {
+	const struct cache_file *x = a, *y = b;
+	if (x->mtime.tv_sec != y->mtime.tv_sec) {
+		return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+	}
+	return (x->mtime.tv_nsec > y->mtime.tv_nsec) -
+		(x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+/**
+ * Removes the least recently used files if they don't fit in the limit,
+ * until there's some room left, and counts what's left.
+ */
+static void trim(struct wsbg_disk_cache *cache) {
+	int dir_fd = open(cache->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = dir_fd != -1 ? fdopendir(dir_fd) : NULL;
+	if (!dir) {
+		if (dir_fd != -1) {
+			close(dir_fd);
+		}
+		return;
+	}
+
+	struct cache_file *files = NULL;
+	size_t count = 0, capacity = 0, total = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		size_t length = strlen(entry->d_name);
+		struct stat st;
+		bool buf = length > 4 && !strcmp(entry->d_name + length - 4, ".buf");
+		bool raw = length > 4 && !strcmp(entry->d_name + length - 4, ".raw");
+		bool info = length > 5 && !strcmp(entry->d_name + length - 5, ".info");
+		if (!(buf || raw || info) ||
+				fstatat(dir_fd, entry->d_name, &st, 0) == -1) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			struct cache_file *grown = realloc(files, capacity * sizeof *files);
+			if (!grown) {
+				wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+				break;
+			}
+			files = grown;
+		}
+		if (!(files[count].name = strdup(entry->d_name))) {
+			break;
+		}
+		files[count].size = st.st_size;
+		files[count].mtime = st.st_mtim;
+		total += st.st_size;
+		++count;
+	}
+
+	qsort(files, count, sizeof *files, compare_mtime);
+	size_t target = total > cache->max_size ?
+		cache->max_size - cache->max_size / TRIM_SLACK_DIV : total;
+	for (size_t i = 0; i < count; ++i) {
+		if (total > target &&
+				unlinkat(dir_fd, files[i].name, 0) == 0) {
+			total -= files[i].size;
+		}
+		free(files[i].name);
+	}
+	free(files);
+	closedir(dir);
+	atomic_store(&cache->size, total);
+}
+
+/**
+ * Counts a file of `size` bytes that was just stored, and trims the cache
+ * if that takes it beyond the limit.
+ */
+static void add_file(struct wsbg_disk_cache *cache, size_t size) {
+	if (atomic_fetch_add(&cache->size, size) + size > cache->max_size) {
+		trim(cache);
+	}
+}
+
+bool wsbg_disk_cache_load_info(struct wsbg_disk_cache *cache,
+		struct wsbg_image *image, bool *opaque) {
+	struct disk_source expected = {0};
+	if (!get_source("wsbginf", image->path, &expected)) {
+		return false;
+	}
+	char *path = get_file_path(cache,
+			&expected, sizeof expected, image->path, ".info");
+	if (!path) {
+		return false;
+	}
+	struct disk_info info;
+	int fd = open_file(path, &expected, image->path, &info, sizeof info, 0);
+	free(path);
+	if (fd == -1) {
+		return false;
+	}
+	close(fd);
+	if (info.width <= 0 || info.height <= 0) {
+		return false;
+	}
+	image->width = info.width;
+	image->height = info.height;
+	image->is_scalable = info.is_scalable;
+	image->is_reducible = info.is_reducible;
+	*opaque = info.opaque;
+	return true;
+}
+
+void wsbg_disk_cache_store_info(struct wsbg_disk_cache *cache,
+		const struct wsbg_image *image) {
+	// Zeroed first, so that padding compares equal
+	struct disk_info info;
+	memset(&info, 0, sizeof info);
+	if (!get_source("wsbginf", image->path, &info.source)) {
+		return;
+	}
+	info.width = image->width;
+	info.height = image->height;
+	info.is_scalable = image->is_scalable;
+	info.is_reducible = image->is_reducible;
+	info.opaque = !image->background.a;
+
+	char *path = get_file_path(cache,
+			&info.source, sizeof info.source, image->path, ".info");
+	char *tmp_path;
+	int fd = path ? create_file(path, &tmp_path) : -1;
+	if (fd != -1 && finish_file(fd, tmp_path, path,
+				write_header(fd, &info, sizeof info, image->path, 0))) {
+		add_file(cache, sizeof info + strlen(image->path));
+	}
+	free(path);
+}
+
+static bool get_image_header(const struct wsbg_image *image,
+		struct wsbg_color background, struct disk_image *header) {
+	// Zeroed first, so that padding compares equal
+	memset(header, 0, sizeof *header);
+	if (!get_source("wsbgsrc", image->path, &header->source)) {
+		return false;
+	}
+	header->background[0] = background.r;
+	header->background[1] = background.g;
+	header->background[2] = background.b;
+	header->background[3] = background.a;
+	return true;
+}
+
+static char *get_image_path(struct wsbg_disk_cache *cache,
+		const struct disk_image *header, const char *image_path) {
+	// The raw header is left out, as it's only known once loaded
+	return get_file_path(cache, &header->source,
+			sizeof *header - offsetof(struct disk_image, source),
+			image_path, ".raw");
+}
+
+bool wsbg_disk_cache_load_image(struct wsbg_disk_cache *cache,
+		struct wsbg_image *image, struct wsbg_color background) {
+	struct disk_image expected;
+	if (!get_image_header(image, background, &expected)) {
+		return false;
+	}
+	char *path = get_image_path(cache, &expected, image->path);
+	if (!path) {
+		return false;
+	}
+	struct disk_image header;
+	int fd = open_file(path, &expected.source, image->path,
+			&header, sizeof header, offsetof(struct disk_image, source));
+	free(path);
+	if (fd == -1) {
+		return false;
+	}
+	bool hit = memcmp(header.background, expected.background,
+				sizeof header.background) == 0 &&
+			map_raw_image(image, fd, false);
+	close(fd);
+	if (hit) {
+		image->background = background;
+	}
+	return hit;
+}
+
+bool wsbg_disk_cache_store_image(struct wsbg_disk_cache *cache,
+		const struct wsbg_image *image) {
+	struct disk_image header;
+	int32_t width = image->width, height = image->height;
+	int32_t stride = width * 4;
+	size_t size = DATA_OFFSET + (size_t)height * stride;
+	if (size > cache->max_size ||
+			!get_image_header(image, image->background, &header)) {
+		return false;
+	}
+	memcpy(header.raw.magic, WSBG_RAW_MAGIC, sizeof header.raw.magic);
+	header.raw.version = WSBG_RAW_VERSION;
+	header.raw.offset = DATA_OFFSET;
+	header.raw.width = width;
+	header.raw.height = height;
+	header.raw.stride = stride;
+	header.raw.format = PIXMAN_x8r8g8b8;
+
+	char *path = get_image_path(cache, &header, image->path);
+	char *tmp_path;
+	int fd = path ? create_file(path, &tmp_path) : -1;
+	if (fd == -1) {
+		free(path);
+		return false;
+	}
+
+	// Converted straight into the file, in the format buffers are usually in
+	bool written = write_header(fd, &header, sizeof header,
+				image->path, DATA_OFFSET) &&
+			ftruncate(fd, size) == 0;
+	void *data = written ?
+		mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+		MAP_FAILED;
+	pixman_image_t *dest = data != MAP_FAILED ?
+		pixman_image_create_bits_no_clear(PIXMAN_x8r8g8b8, width, height,
+			(uint32_t *)((uint8_t *)data + DATA_OFFSET), stride) : NULL;
+	written = dest != NULL;
+	if (dest) {
+		pixman_image_composite32(PIXMAN_OP_SRC, image->surface, NULL, dest,
+				0, 0, 0, 0, 0, 0, width, height);
+		pixman_image_unref(dest);
+	}
+	if (data != MAP_FAILED) {
+		munmap(data, size);
+	}
+
+	written = finish_file(fd, tmp_path, path, written);
+	if (written) {
+		add_file(cache, size);
+	}
+	free(path);
+	return written;
+}
+
+/**
+ * Fills in the header of the buffer described by `key`, but for its
+ * stride. Returns false if the image file can't be found.
+ */
+static bool get_header(const struct wsbg_buffer *key,
+		struct disk_header *header) {
+	// Zeroed first, so that padding compares equal
+	memset(header, 0, sizeof *header);
+	if (!get_source("wsbgbuf", key->image->path, &header->source)) {
+		return false;
+	}
+	header->width = key->width;
+	header->height = key->height;
+	header->format = key->format;
+	header->x = key->transform.x;
+	header->y = key->transform.y;
+	header->scale_x = key->transform.scale_x;
+	header->scale_y = key->transform.scale_y;
+	header->background[0] = key->background.r;
+	header->background[1] = key->background.g;
+	header->background[2] = key->background.b;
+	header->background[3] = key->background.a;
+	header->repeat = key->repeat;
+	header->filter = key->filter;
+	return true;
+}
+
+struct wsbg_shm_block *wsbg_disk_cache_load(struct wsbg_disk_cache *cache,
+		struct wsbg_shm *shm, const struct wsbg_buffer *key,
+		struct wl_buffer **buffer, size_t *size) {
+	// The stride is read from the file, so it doesn't take part in the name
+	struct disk_header expected;
+	if (!get_header(key, &expected)) {
+		return false;
+	}
+	char *path = get_file_path(cache,
+			&expected, sizeof expected, key->image->path, ".buf");
+	if (!path) {
+		return NULL;
+	}
+	struct disk_header header;
+	int fd = open_file(path, &expected.source, key->image->path,
+			&header, sizeof header, 0);
+	free(path);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct wsbg_shm_block *block = NULL;
+	struct stat st;
+	expected.stride = header.stride;
+	if (fstat(fd, &st) == -1 ||
+			memcmp(&header, &expected, sizeof header) != 0 ||
+			header.stride < header.width ||
+			st.st_size != DATA_OFFSET + (off_t)header.height * header.stride) {
+		goto close;
+	}
+
+	// The pixels are copied rather than shared, so that the compositor
+	// never waits on the disk, nor faults on a file changed under it
+	*size = (size_t)header.height * header.stride;
+	block = wsbg_shm_alloc(shm, header.width, header.height,
+			header.stride, header.format, buffer);
+	if (block && !read_all(fd, wsbg_shm_block_data(block),
+				*size, DATA_OFFSET)) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read cached buffer");
+		wl_buffer_destroy(*buffer);
+		wsbg_shm_free(block);
+		block = NULL;
+	}
+
+close:
+	close(fd);
+	return block;
+}
+
+void wsbg_disk_cache_store(struct wsbg_disk_cache *cache,
+		const struct wsbg_buffer *key, const void *data, int32_t stride) {
+	struct disk_header header;
+	size_t size = (size_t)key->height * stride;
+	if (DATA_OFFSET + size > cache->max_size || !get_header(key, &header)) {
+		return;
+	}
+
+	// Named after the header without the stride, like when loading
+	char *path = get_file_path(cache,
+			&header, sizeof header, key->image->path, ".buf");
+	char *tmp_path;
+	int fd = path ? create_file(path, &tmp_path) : -1;
+	header.stride = stride;
+	if (fd != -1 && finish_file(fd, tmp_path, path,
+				write_header(fd, &header, sizeof header,
+					key->image->path, DATA_OFFSET) &&
+				write_all(fd, data, size))) {
+		add_file(cache, DATA_OFFSET + size);
+	}
+	free(path);
+}
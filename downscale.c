@@ -0,0 +1,401 @@
+#define _POSIX_C_SOURCE 200809
+#include <pixman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// AVX2 is used where the CPU has it, without requiring it to build
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DOWNSCALE_AVX2
+#endif
+#include "downscale.h"
+#include "log.h"
+
+// Weights of the image pixels a buffer pixel covers add up to this
+#define WEIGHT_ONE (1 << 15)
+
+static int64_t floor_div(int64_t x, int64_t y) {
+	return x / y - (x % y < 0);
+}
+
+/**
+ * Gets the weights of the pixels of a row or column of `size` pixels
+ * covered by [`start`, `end`) in Q16 pixels. Returns their number, and
+ * the first of them in `first`. Parts outside the row get no weight.
+ */
+static int32_t get_coverage(int64_t start, int64_t end, int32_t size,
+		uint16_t *weights, int32_t *first) {
+	int64_t length = end - start;
+	int64_t i1 = floor_div(start, Q16);
+	int64_t i2 = floor_div(end + Q16 - 1, Q16);
+	i1 = i1 < 0 ? 0 : i1;
+	i2 = i2 > size ? size : i2;
+	*first = i1;
+	if (i2 <= i1) {
+		*first = 0;
+		return 0;
+	}
+
+	int32_t total = 0, largest = 0;
+	for (int64_t i = i1; i < i2; ++i) {
+		int64_t a = i * Q16 > start ? i * Q16 : start;
+		int64_t b = (i + 1) * Q16 < end ? (i + 1) * Q16 : end;
+		uint16_t weight = ((b - a) * WEIGHT_ONE + length / 2) / length;
+		weights[i - i1] = weight;
+		total += weight;
+		if (weight > weights[largest]) {
+			largest = i - i1;
+		}
+	}
+
+	// Rounding errors go to the largest weight, so that a pixel inside
+	// the image is an exact average
+	if (start >= 0 && end <= size * Q16) {
+		weights[largest] += WEIGHT_ONE - total;
+	} else if (total > WEIGHT_ONE) {
+		weights[largest] -= total - WEIGHT_ONE;
+	}
+	return i2 - i1;
+}
+
+static int64_t source_position(int32_t x, int64_t offset, int64_t scale) {
+	return floor_div((x * Q16 + offset) * scale, Q16);
+}
+
+/**
+ * Returns the size of the blocks each buffer pixel covers exactly, or 0
+ * if the transform isn't a shrink by 2 or 4 which stays inside the image.
+ */
+static int get_ratio(const struct downscale *downscale, int32_t height) {
+	if (downscale->scale_x != downscale->scale_y ||
+			(downscale->scale_x != 2 * Q16 && downscale->scale_x != 4 * Q16)) {
+		return 0;
+	}
+	int64_t x1 = source_position(0, downscale->x, downscale->scale_x);
+	int64_t y1 = source_position(0, downscale->y, downscale->scale_y);
+	int64_t x2 = source_position(
+			downscale->width, downscale->x, downscale->scale_x);
+	int64_t y2 = source_position(height, downscale->y, downscale->scale_y);
+	if ((x1 & (Q16 - 1)) || (y1 & (Q16 - 1)) || x1 < 0 || y1 < 0 ||
+			x2 > downscale->source_width * Q16 ||
+			y2 > downscale->source_height * Q16) {
+		return 0;
+	}
+	return downscale->scale_x / Q16;
+}
+
+bool downscale_init(struct downscale *downscale,
+		int32_t width, int32_t height,
+		const struct wsbg_image_transform *transform,
+		int32_t source_width, int32_t source_height,
+		uint32_t background) {
+	*downscale = (struct downscale){
+		.width = width,
+		.source_width = source_width,
+		.source_height = source_height,
+		.x = transform->x,
+		.y = transform->y,
+		.scale_x = transform->scale_x,
+		.scale_y = transform->scale_y,
+		.background = background,
+		.count_max_y = transform->scale_y / Q16 + 2,
+	};
+
+	int32_t count_max_x = transform->scale_x / Q16 + 2;
+	downscale->columns = calloc(width, sizeof *downscale->columns);
+	downscale->counts = calloc(width, sizeof *downscale->counts);
+	downscale->offsets = calloc(width, sizeof *downscale->offsets);
+	downscale->weights = calloc((size_t)width * count_max_x,
+			sizeof *downscale->weights);
+	if (!downscale->columns || !downscale->counts ||
+			!downscale->offsets || !downscale->weights) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		downscale_finish(downscale);
+		return false;
+	}
+
+	int32_t offset = 0, span_x2 = 0;
+	downscale->span_x = source_width;
+	for (int32_t x = 0; x < width; ++x) {
+		int32_t count = get_coverage(
+				source_position(x, downscale->x, downscale->scale_x),
+				source_position(x + 1, downscale->x, downscale->scale_x),
+				source_width, downscale->weights + offset,
+				&downscale->columns[x]);
+		downscale->counts[x] = count;
+		downscale->offsets[x] = offset;
+		offset += count;
+		if (count && downscale->columns[x] < downscale->span_x) {
+			downscale->span_x = downscale->columns[x];
+		}
+		if (count && downscale->columns[x] + count > span_x2) {
+			span_x2 = downscale->columns[x] + count;
+		}
+	}
+	downscale->span_width = span_x2 > downscale->span_x ?
+			span_x2 - downscale->span_x : 0;
+
+	downscale->ratio = get_ratio(downscale, height);
+	return true;
+}
+
+void downscale_finish(struct downscale *downscale) {
+	free(downscale->columns);
+	free(downscale->counts);
+	free(downscale->offsets);
+	free(downscale->weights);
+	*downscale = (struct downscale){0};
+}
+
+#ifdef DOWNSCALE_AVX2
+/**
+ * Adds whole blocks of 32 of the `n` `bytes` times `weight` to `sums`, and
+ * returns how many were added.
+ */
+__attribute__((target("avx2")))
+static int32_t accumulate_avx2(uint32_t *sums, const uint8_t *bytes,
+		int32_t n, uint16_t weight) {
+	__m256i weights = _mm256_set1_epi16(weight);
+	int32_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		for (int half = 0; half < 2; ++half) {
+			__m256i pixels = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(const __m128i *)(bytes + i + half * 16)));
+			__m256i low = _mm256_mullo_epi16(pixels, weights);
+			__m256i high = _mm256_mulhi_epu16(pixels, weights);
+			// Unpacking works within 128-bit lanes, which leaves bytes
+			// 0-3 and 8-11 in one vector, and 4-7 and 12-15 in the other
+			__m256i a = _mm256_unpacklo_epi16(low, high);
+			__m256i b = _mm256_unpackhi_epi16(low, high);
+
+			__m256i *dest = (__m256i *)(sums + i + half * 16);
+			_mm256_storeu_si256(dest, _mm256_add_epi32(
+					_mm256_loadu_si256(dest),
+					_mm256_permute2x128_si256(a, b, 0x20)));
+			_mm256_storeu_si256(dest + 1, _mm256_add_epi32(
+					_mm256_loadu_si256(dest + 1),
+					_mm256_permute2x128_si256(a, b, 0x31)));
+		}
+	}
+	return i;
+}
+#endif
+
+/**
+ * Adds the bytes of `count` pixels times `weight` to `sums`.
+ */
+static void accumulate_row(uint32_t *sums, const uint32_t *row,
+		int32_t count, uint16_t weight) {
+	const uint8_t *bytes = (const uint8_t *)row;
+	int32_t i = 0, n = count * 4;
+#ifdef DOWNSCALE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		i = accumulate_avx2(sums, bytes, n, weight);
+	}
+#endif
+#ifdef __SSE2__
+	__m128i weights = _mm_set1_epi16(weight);
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(bytes + i));
+		__m128i lo = _mm_unpacklo_epi8(pixels, zero);
+		__m128i hi = _mm_unpackhi_epi8(pixels, zero);
+		__m128i lo_low = _mm_mullo_epi16(lo, weights);
+		__m128i lo_high = _mm_mulhi_epu16(lo, weights);
+		__m128i hi_low = _mm_mullo_epi16(hi, weights);
+		__m128i hi_high = _mm_mulhi_epu16(hi, weights);
+
+		__m128i *dest = (__m128i *)(sums + i);
+		_mm_storeu_si128(dest, _mm_add_epi32(_mm_loadu_si128(dest),
+				_mm_unpacklo_epi16(lo_low, lo_high)));
+		_mm_storeu_si128(dest + 1, _mm_add_epi32(_mm_loadu_si128(dest + 1),
+				_mm_unpackhi_epi16(lo_low, lo_high)));
+		_mm_storeu_si128(dest + 2, _mm_add_epi32(_mm_loadu_si128(dest + 2),
+				_mm_unpacklo_epi16(hi_low, hi_high)));
+		_mm_storeu_si128(dest + 3, _mm_add_epi32(_mm_loadu_si128(dest + 3),
+				_mm_unpackhi_epi16(hi_low, hi_high)));
+	}
+#endif
+	for (; i < n; ++i) {
+		sums[i] += bytes[i] * weight;
+	}
+}
+
+/**
+ * Averages 2x2 blocks of `rows` into `count` pixels of `dest`.
+ */
+static void shrink_2(uint32_t *dest, const uint32_t *rows, int32_t stride,
+		int32_t count) {
+	const uint8_t *row1 = (const uint8_t *)rows;
+	const uint8_t *row2 = (const uint8_t *)(rows + stride);
+	uint8_t *out = (uint8_t *)dest;
+	int32_t x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(2);
+	for (; x + 2 <= count; x += 2) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(row1 + x * 8));
+		__m128i b = _mm_loadu_si128((const __m128i *)(row2 + x * 8));
+		__m128i lo = _mm_add_epi16(
+				_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_add_epi16(
+				_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+		hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+		__m128i sums = _mm_srli_epi16(
+				_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), round), 2);
+		_mm_storel_epi64((__m128i *)(out + x * 4),
+				_mm_packus_epi16(sums, sums));
+	}
+#endif
+	for (; x < count; ++x) {
+		for (int c = 0; c < 4; ++c) {
+			unsigned sum = row1[x * 8 + c] + row1[x * 8 + 4 + c] +
+				row2[x * 8 + c] + row2[x * 8 + 4 + c];
+			out[x * 4 + c] = (sum + 2) >> 2;
+		}
+	}
+}
+
+/**
+ * Averages 4x4 blocks of `rows` into `count` pixels of `dest`.
+ */
+static void shrink_4(uint32_t *dest, const uint32_t *rows, int32_t stride,
+		int32_t count) {
+	uint8_t *out = (uint8_t *)dest;
+	int32_t x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(8);
+	for (; x < count; ++x) {
+		__m128i sums = zero;
+		for (int r = 0; r < 4; ++r) {
+			__m128i a = _mm_loadu_si128(
+					(const __m128i *)(rows + r * stride + x * 4));
+			sums = _mm_add_epi16(sums, _mm_add_epi16(
+					_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero)));
+		}
+		sums = _mm_add_epi16(sums, _mm_srli_si128(sums, 8));
+		sums = _mm_srli_epi16(_mm_add_epi16(sums, round), 4);
+		uint32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sums, sums));
+		memcpy(out + x * 4, &pixel, 4);
+	}
+#endif
+	for (; x < count; ++x) {
+		for (int c = 0; c < 4; ++c) {
+			unsigned sum = 0;
+			for (int r = 0; r < 4; ++r) {
+				const uint8_t *row = (const uint8_t *)(rows + r * stride);
+				for (int i = 0; i < 4; ++i) {
+					sum += row[(x * 4 + i) * 4 + c];
+				}
+			}
+			out[x * 4 + c] = (sum + 8) >> 4;
+		}
+	}
+}
+
+/**
+ * Averages the columns covered by each buffer pixel of `sums`, which hold
+ * image rows weighted by `weight_y` in total.
+ */
+static void shrink_row(const struct downscale *downscale, uint32_t *dest,
+		const uint32_t *sums, uint32_t weight_y) {
+	const uint8_t *background = (const uint8_t *)&downscale->background;
+	uint8_t *out = (uint8_t *)dest;
+	for (int32_t x = 0; x < downscale->width; ++x) {
+		const uint16_t *weights = downscale->weights + downscale->offsets[x];
+		const uint32_t *column =
+			sums + (downscale->columns[x] - downscale->span_x) * 4;
+		uint32_t totals[4] = {0}, weight_x = 0;
+		for (int32_t i = 0; i < downscale->counts[x]; ++i) {
+			// Sums of up to 255 * WEIGHT_ONE, rounded down to 16 bits
+			for (int c = 0; c < 4; ++c) {
+				totals[c] += weights[i] * ((column[i * 4 + c] + 64) >> 7);
+			}
+			weight_x += weights[i];
+		}
+		uint32_t missing = WEIGHT_ONE -
+			((weight_x * weight_y + WEIGHT_ONE / 2) >> 15);
+		for (int c = 0; c < 4; ++c) {
+			out[x * 4 + c] = (totals[c] + background[c] * 256 * missing +
+					(1 << 22)) >> 23;
+		}
+	}
+}
+
+void downscale_band(const struct downscale *downscale,
+		pixman_image_t *dest, pixman_image_t *source, int32_t y) {
+	int32_t width = downscale->width;
+	int32_t height = pixman_image_get_height(dest);
+	int32_t span_width = downscale->span_width;
+	int ratio = downscale->ratio;
+	int row_count = ratio ? ratio : 1;
+
+	uint32_t *rows = malloc(((size_t)span_width * row_count + 1) * 4);
+	uint32_t *sums = malloc(((size_t)span_width + 1) * 16);
+	uint16_t *weights_y = malloc(downscale->count_max_y * sizeof *weights_y);
+	uint32_t *out = malloc((size_t)width * 4);
+	pixman_image_t *rows_image = rows ? pixman_image_create_bits_no_clear(
+			PIXMAN_x8r8g8b8, span_width, row_count, rows, span_width * 4) :
+		NULL;
+	pixman_image_t *out_image = out ? pixman_image_create_bits_no_clear(
+			PIXMAN_x8r8g8b8, width, 1, out, width * 4) : NULL;
+	if (!rows || !sums || !weights_y || !out ||
+			(span_width && !rows_image) || !out_image) {
+		wsbg_log(LOG_ERROR, "Memory allocation failed");
+		goto cleanup;
+	}
+
+	// Rows of the destination are written in place if they have the same
+	// format, and converted by pixman otherwise
+	bool direct = pixman_image_get_format(dest) == PIXMAN_x8r8g8b8;
+	uint8_t *dest_data = (uint8_t *)pixman_image_get_data(dest);
+	int dest_stride = pixman_image_get_stride(dest);
+
+	for (int32_t j = 0; j < height; ++j) {
+		uint32_t *row = direct ? (uint32_t *)(dest_data + j * dest_stride) : out;
+		int32_t first;
+		int32_t count = get_coverage(
+				source_position(y + j, downscale->y, downscale->scale_y),
+				source_position(y + j + 1, downscale->y, downscale->scale_y),
+				downscale->source_height, weights_y, &first);
+
+		if (ratio) {
+			pixman_image_composite32(PIXMAN_OP_SRC, source, NULL, rows_image,
+					downscale->span_x, first, 0, 0, 0, 0, span_width, ratio);
+			(ratio == 2 ? shrink_2 : shrink_4)(row, rows, span_width, width);
+		} else {
+			memset(sums, 0, (size_t)span_width * 16);
+			uint32_t weight_y = 0;
+			for (int32_t i = 0; i < count && span_width; ++i) {
+				pixman_image_composite32(PIXMAN_OP_SRC, source, NULL,
+						rows_image, downscale->span_x, first + i,
+						0, 0, 0, 0, span_width, 1);
+				accumulate_row(sums, rows, span_width, weights_y[i]);
+				weight_y += weights_y[i];
+			}
+			shrink_row(downscale, row, sums, weight_y);
+		}
+
+		if (!direct) {
+			pixman_image_composite32(PIXMAN_OP_SRC, out_image, NULL, dest,
+					0, 0, 0, 0, 0, j, width, 1);
+		}
+	}
+
+cleanup:
+	if (out_image) {
+		pixman_image_unref(out_image);
+	}
+	if (rows_image) {
+		pixman_image_unref(rows_image);
+	}
+	free(out);
+	free(weights_y);
+	free(sums);
+	free(rows);
+}
@@ -1,8 +1,14 @@
 #define _POSIX_C_SOURCE 200809
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pixman.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "image.h"
 #include "log.h"
 
@@ -135,6 +141,228 @@ void get_wsbg_image_transform(
 		height_q16 <= transform->y + dest_height;
 }
 
+static void free_image_data(pixman_image_t *image, void *data) {
+	free(data);
+}
+
+#if HAVE_LIBJPEG
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void exit_jpeg_error(j_common_ptr info) {
+	struct jpeg_error *err = (struct jpeg_error *)info->err;
+	longjmp(err->jump, 1);
+}
+
+static void output_jpeg_message(j_common_ptr info) {
+	char message[JMSG_LENGTH_MAX];
+	info->err->format_message(info, message);
+	wsbg_log(LOG_DEBUG, "libjpeg: %s", message);
+}
+
+#if HAVE_GDK_PIXBUF
+static uint32_t read_exif(const uint8_t *p, int size, bool little_endian) {
+	uint32_t value = 0;
+	for (int i = 0; i < size; ++i) {
+		value |= (uint32_t)p[little_endian ? i : size - 1 - i] << (8 * i);
+	}
+	return value;
+}
+
+/**
+ * Returns the EXIF orientation saved from the APP1 marker, or 1 if there
+ * is none.
+ */
+static int get_jpeg_orientation(struct jpeg_decompress_struct *info) {
+	for (jpeg_saved_marker_ptr marker = info->marker_list; marker;
+			marker = marker->next) {
+		if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 14 ||
+				memcmp(marker->data, "Exif\0\0", 6) != 0) {
+			continue;
+		}
+		const uint8_t *tiff = marker->data + 6;
+		size_t size = marker->data_length - 6;
+		bool little_endian = tiff[0] == 'I';
+		// Segments without a TIFF header aren't EXIF data to be trusted
+		if (tiff[0] != tiff[1] || (tiff[0] != 'I' && tiff[0] != 'M') ||
+				read_exif(tiff + 2, 2, little_endian) != 0x002A) {
+			continue;
+		}
+		uint32_t ifd = read_exif(tiff + 4, 4, little_endian);
+		if (ifd > size - 2) {
+			return 1;
+		}
+		unsigned count = read_exif(tiff + ifd, 2, little_endian);
+		for (unsigned i = 0; i < count; ++i) {
+			size_t entry = ifd + 2 + i * 12;
+			if (entry + 12 > size) {
+				break;
+			}
+			if (read_exif(tiff + entry, 2, little_endian) == 0x0112) {
+				return read_exif(tiff + entry + 8, 2, little_endian);
+			}
+		}
+	}
+	return 1;
+}
+#endif
+
+/**
+ * Decodes `image` if it's a JPEG image, at the smallest DCT scale which is
+ * still at least `scaled_width`x`scaled_height`, straight to 32-bit pixels.
+ * Only reads the size if it isn't known yet, and no size is asked for.
+ * Returns false if it isn't a JPEG image this can decode.
+ *
+ * With `dest`, decodes it at full size into `dest` instead, as rows of
+ * xrgb8888 `dest_stride` apart, and returns whether it did.
+ */
+static bool load_jpeg(struct wsbg_image *image,
+		int scaled_width, int scaled_height,
+		uint8_t *dest, int dest_stride) {
+	FILE *file = fopen(image->path, "rbe");
+	if (!file) {
+		return false;
+	}
+	uint8_t magic[3];
+	if (fread(magic, 1, sizeof magic, file) != sizeof magic ||
+			magic[0] != 0xFF || magic[1] != 0xD8 || magic[2] != 0xFF) {
+		fclose(file);
+		return false;
+	}
+	rewind(file);
+
+	struct jpeg_decompress_struct info;
+	struct jpeg_error err;
+	uint8_t *volatile data = NULL;
+	info.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = exit_jpeg_error;
+	err.mgr.output_message = output_jpeg_message;
+	if (setjmp(err.jump)) {
+		// Images failing to decode into a buffer are loaded again, which
+		// reports the error
+		if (!dest) {
+			char message[JMSG_LENGTH_MAX];
+			err.mgr.format_message((j_common_ptr)&info, message);
+			wsbg_log(LOG_ERROR, "Failed to load %s: %s",
+					image->path, message);
+			image->is_reducible = false;
+		}
+		jpeg_destroy_decompress(&info);
+		free(data);
+		fclose(file);
+		return !dest;
+	}
+	jpeg_create_decompress(&info);
+	jpeg_stdio_src(&info, file);
+#if HAVE_GDK_PIXBUF
+	jpeg_save_markers(&info, JPEG_APP0 + 1, 0xFFFF);
+#endif
+	jpeg_read_header(&info, TRUE);
+
+	bool supported = info.jpeg_color_space != JCS_CMYK &&
+		info.jpeg_color_space != JCS_YCCK;
+#if HAVE_GDK_PIXBUF
+	// Rotated images are left to gdk-pixbuf, which applies the orientation
+	supported = supported && get_jpeg_orientation(&info) == 1;
+#endif
+	if (dest) {
+		// The buffer is laid out for the size known so far
+#ifdef JCS_EXTENSIONS
+		supported = supported && (int)info.image_width == image->width &&
+			(int)info.image_height == image->height;
+		scaled_width = image->width;
+		scaled_height = image->height;
+#else
+		supported = false;
+#endif
+	}
+	if (!supported) {
+		jpeg_destroy_decompress(&info);
+		fclose(file);
+		return false;
+	}
+
+	bool probe = image->width <= 0 && scaled_width == 0;
+	image->width = info.image_width;
+	image->height = info.image_height;
+	image->is_reducible = true;
+	image->background = (struct wsbg_color){};
+	if (probe) {
+		jpeg_destroy_decompress(&info);
+		fclose(file);
+		return true;
+	}
+
+	// libjpeg scales by num/8 while computing the inverse DCT, which is
+	// about as cheap as not scaling at all. Without a scaled size, images
+	// are decoded at full size, like other images.
+	info.scale_denom = 8;
+	info.scale_num = scaled_width == 0 && scaled_height == 0 ? 8 : 1;
+	for (; info.scale_num < 8; ++info.scale_num) {
+		if ((info.image_width * info.scale_num + 7) / 8 >=
+					(unsigned)scaled_width &&
+				(info.image_height * info.scale_num + 7) / 8 >=
+					(unsigned)scaled_height) {
+			break;
+		}
+	}
+#ifdef JCS_EXTENSIONS
+	// Decoded straight to the layout of PIXMAN_x8r8g8b8, or of xrgb8888
+	// buffers, which are little-endian
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	info.out_color_space = JCS_EXT_BGRX;
+#else
+	info.out_color_space = dest ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+#endif
+	pixman_format_code_t format = PIXMAN_x8r8g8b8;
+#else
+	info.out_color_space = JCS_RGB;
+	pixman_format_code_t format = PIXMAN_b8g8r8;
+#endif
+	info.dct_method = JDCT_ISLOW;
+	jpeg_start_decompress(&info);
+
+	int width = info.output_width, height = info.output_height;
+	int stride = dest_stride;
+	uint8_t *rows = dest;
+	if (!dest) {
+		stride = (width * info.output_components + 3) & ~3;
+		if (!(rows = data = malloc((size_t)height * stride))) {
+			wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+			jpeg_destroy_decompress(&info);
+			fclose(file);
+			return true;
+		}
+	}
+	while (info.output_scanline < info.output_height) {
+		JSAMPROW row = rows + (size_t)info.output_scanline * stride;
+		jpeg_read_scanlines(&info, &row, 1);
+	}
+	jpeg_finish_decompress(&info);
+	jpeg_destroy_decompress(&info);
+	fclose(file);
+	if (dest) {
+		return true;
+	}
+
+	image->surface = pixman_image_create_bits_no_clear(
+			format, width, height, (uint32_t *)data, stride);
+	if (!image->surface) {
+		free(data);
+		return true;
+	}
+	pixman_image_set_destroy_function(
+			image->surface, &free_image_data, data);
+	return true;
+}
+#endif // HAVE_LIBJPEG
+
 #if HAVE_GDK_PIXBUF
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
@@ -236,11 +464,7 @@ static void load_gdk_pixbuf(struct wsbg_image *image,
 #else // !HAVE_GDK_PIXBUF
 #include <png.h>
 
-static void free_image_data(pixman_image_t *image, void *data) {
-	free(data);
-}
-
-static void load_png(struct wsbg_image *image) {
+static void load_png(struct wsbg_image *image, bool probe) {
 	png_image reader = {};
 	reader.version = PNG_IMAGE_VERSION;
 
@@ -255,6 +479,10 @@ static void load_png(struct wsbg_image *image) {
 
 	image->width = reader.width;
 	image->height = reader.height;
+	if (probe) {
+		png_image_free(&reader);
+		return;
+	}
 
 	int stride = PNG_IMAGE_ROW_STRIDE(reader);
 	void *buffer = malloc(PNG_IMAGE_BUFFER_SIZE(reader, stride));
@@ -285,15 +513,200 @@ static void load_png(struct wsbg_image *image) {
 	pixman_image_set_destroy_function(
 			image->surface, &free_image_data, buffer);
 }
+
+/**
+ * Decodes `image` into `dest` as rows of xrgb8888 `dest_stride` apart, if
+ * it's a PNG image without transparency.
+ */
+static bool decode_png(struct wsbg_image *image,
+		uint8_t *dest, int dest_stride) {
+	png_image reader = {};
+	reader.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_file(&reader, image->path)) {
+		return false;
+	}
+	// Transparent images would need blending with the background
+	if ((reader.format & PNG_FORMAT_FLAG_ALPHA) ||
+			(int)reader.width != image->width ||
+			(int)reader.height != image->height) {
+		png_image_free(&reader);
+		return false;
+	}
+
+	// Filled with opaque alpha, which xrgb8888 ignores
+	reader.format = PNG_FORMAT_BGRA;
+	return png_image_finish_read(&reader, NULL, dest, dest_stride, NULL);
+}
 #endif // HAVE_GDK_PIXBUF
 
+struct raw_mapping {
+	void *data;
+	size_t size;
+};
+
+static void unmap_raw_image(pixman_image_t *image, void *data) {
+	struct raw_mapping *mapping = data;
+	munmap(mapping->data, mapping->size);
+	free(mapping);
+}
+
+static bool read_all(int fd, void *data, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t n = pread(fd, data, size, offset);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data = (char *)data + n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/**
+ * Copies the pixels of the raw image file `fd`, described by `header`, as
+ * the surface of `image`.
+ */
+static bool copy_raw_image(struct wsbg_image *image, int fd,
+		const struct wsbg_raw_header *header) {
+	size_t size = (size_t)header->height * header->stride;
+	void *data = malloc(size);
+	if (!data) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return false;
+	}
+	if (!read_all(fd, data, size, header->offset)) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read %s", image->path);
+		free(data);
+		return false;
+	}
+	image->surface = pixman_image_create_bits_no_clear(header->format,
+			header->width, header->height, data, header->stride);
+	if (!image->surface) {
+		free(data);
+		return false;
+	}
+	pixman_image_set_destroy_function(
+			image->surface, &free_image_data, data);
+	return true;
+}
+
+/**
+ * Maps the raw image file `fd`, of `size` bytes and described by `header`,
+ * as the surface of `image`.
+ */
+static bool map_raw_file(struct wsbg_image *image, int fd, size_t size,
+		const struct wsbg_raw_header *header) {
+	// Mapped whole, so that the header can take up part of a page
+	struct raw_mapping *mapping = malloc(sizeof *mapping);
+	if (!mapping) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return false;
+	}
+	mapping->size = size;
+	mapping->data = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping->data == MAP_FAILED) {
+		wsbg_log_errno(LOG_ERROR, "Unable to map %s", image->path);
+		free(mapping);
+		return false;
+	}
+
+	// Images are only ever read from, so read-only pages are enough
+	image->surface = pixman_image_create_bits_no_clear(header->format,
+			header->width, header->height,
+			(uint32_t *)((uint8_t *)mapping->data + header->offset),
+			header->stride);
+	if (!image->surface) {
+		munmap(mapping->data, mapping->size);
+		free(mapping);
+		return false;
+	}
+	pixman_image_set_destroy_function(
+			image->surface, &unmap_raw_image, mapping);
+	return true;
+}
+
+bool map_raw_image(struct wsbg_image *image, int fd, bool copy) {
+	struct wsbg_raw_header header;
+	struct stat st;
+	if (pread(fd, &header, sizeof header, 0) != sizeof header ||
+			memcmp(header.magic, WSBG_RAW_MAGIC, sizeof header.magic) != 0 ||
+			fstat(fd, &st) == -1) {
+		return false;
+	}
+
+	pixman_format_code_t format = header.format;
+	if (header.version != WSBG_RAW_VERSION ||
+			PIXMAN_FORMAT_BPP(format) != 32 || PIXMAN_FORMAT_A(format) != 0 ||
+			!pixman_format_supported_source(format) ||
+			header.width <= 0 || header.height <= 0 ||
+			header.stride % 4 != 0 || header.stride / 4 < header.width ||
+			header.offset % 4 != 0 || header.offset < sizeof header ||
+			st.st_size < header.offset ||
+			(st.st_size - header.offset) / header.stride < header.height) {
+		return false;
+	}
+
+	if (copy ? !copy_raw_image(image, fd, &header) :
+			!map_raw_file(image, fd, st.st_size, &header)) {
+		return false;
+	}
+	image->width = header.width;
+	image->height = header.height;
+	image->is_scalable = false;
+	image->is_mapped = true;
+	image->background = (struct wsbg_color){};
+	return true;
+}
+
+/**
+ * Loads `image` if it's a raw image file. Returns false if it isn't one, so
+ * that it's decoded instead.
+ */
+static bool load_raw(struct wsbg_image *image) {
+	int fd = open(image->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	char magic[8];
+	bool is_raw = pread(fd, magic, sizeof magic, 0) == sizeof magic &&
+		memcmp(magic, WSBG_RAW_MAGIC, sizeof magic) == 0;
+	// Unlike the disk cache, users may rewrite the file in place, which
+	// would fault a mapping of it once truncated
+	if (is_raw && !map_raw_image(image, fd, true)) {
+		wsbg_log(LOG_ERROR, "Failed to load %s: Invalid raw image",
+				image->path);
+	}
+	close(fd);
+	return is_raw;
+}
+
+bool is_image_loaded(const struct wsbg_image *image,
+		struct wsbg_color background, int scaled_width, int scaled_height) {
+	if (!image->surface ||
+			(image->background.a && !color_eql(background, image->background))) {
+		return false;
+	}
+	int width = pixman_image_get_width(image->surface);
+	int height = pixman_image_get_height(image->surface);
+	if (scaled_width == 0) {
+		// Reduced images don't stand in for the full size
+		return !image->is_reducible ||
+			(width == image->width && height == image->height);
+	} else if (image->is_reducible) {
+		return scaled_width <= width && scaled_height <= height;
+	}
+	return scaled_width == width && scaled_height == height;
+}
+
 bool load_image(struct wsbg_image *image,
 		struct wsbg_color background, int scaled_width, int scaled_height) {
 	if (image->surface) {
-		if ((!image->background.a || color_eql(background, image->background))
-			&& (scaled_width == 0 || (
-					scaled_width == pixman_image_get_width(image->surface) &&
-					scaled_height == pixman_image_get_height(image->surface)))) {
+		if (is_image_loaded(image, background, scaled_width, scaled_height)) {
 			return true;
 		}
 		unload_image(image);
@@ -302,14 +715,24 @@ bool load_image(struct wsbg_image *image,
 	}
 
 	image->background = background;
+	// Without a size, only the header is read where the format allows it
+	bool probe = image->width == 0 && scaled_width == 0;
 
+	if (!load_raw(image)
+#if HAVE_LIBJPEG
+			&& !load_jpeg(image, scaled_width, scaled_height, NULL, 0)
+#endif
+			) {
 #if HAVE_GDK_PIXBUF
-	load_gdk_pixbuf(image, scaled_width, scaled_height);
+		load_gdk_pixbuf(image, scaled_width, scaled_height);
 #else
-	load_png(image);
+		load_png(image, probe);
 #endif
+	}
 
-	if (!image->surface && !(image->is_scalable && scaled_width == 0)) {
+	// Images are decoded at the size rendering needs, or straight into a
+	// buffer, so probes may only read their size
+	if (!image->surface && !(probe && image->width > 0)) {
 		image->width = -1;
 		return false;
 	}
@@ -326,9 +749,48 @@ bool load_image(struct wsbg_image *image,
 	return true;
 }
 
+bool decode_image(struct wsbg_image *image, void *dest, int32_t dest_stride) {
+	if (image->surface || image->is_scalable || image->width <= 0) {
+		return false;
+	}
+#if HAVE_LIBJPEG
+	if (load_jpeg(image, 0, 0, dest, dest_stride)) {
+		return true;
+	}
+#endif
+#if !HAVE_GDK_PIXBUF
+	if (decode_png(image, dest, dest_stride)) {
+		return true;
+	}
+#endif
+	return false;
+}
+
 void unload_image(struct wsbg_image *image) {
+	for (int i = 0; i < WSBG_MIPMAP_LEVELS; ++i) {
+		if (image->mipmaps[i]) {
+			pixman_image_unref(image->mipmaps[i]);
+			image->mipmaps[i] = NULL;
+		}
+	}
 	if (image->surface) {
 		pixman_image_unref(image->surface);
 		image->surface = NULL;
 	}
+	image->is_mapped = false;
+}
+
+size_t get_image_memory(const struct wsbg_image *image) {
+	size_t memory = 0;
+	if (image->surface) {
+		memory += (size_t)pixman_image_get_height(image->surface) *
+			pixman_image_get_stride(image->surface);
+	}
+	for (int i = 0; i < WSBG_MIPMAP_LEVELS; ++i) {
+		if (image->mipmaps[i]) {
+			memory += (size_t)pixman_image_get_height(image->mipmaps[i]) *
+				pixman_image_get_stride(image->mipmaps[i]);
+		}
+	}
+	return memory;
 }
@@ -0,0 +1,58 @@
+#ifndef _WSBG_ANIMATION_H
+#define _WSBG_ANIMATION_H
+
+#include <stdint.h>
+#include "state.h"
+
+/**
+ * Plays animated images on the outputs showing them. Each image is parsed
+ * once, on a thread of its own. Each frame is decoded when it is due, and
+ * drawn at its own size into one of a few shared memory buffers, which are
+ * reused once the compositor releases them. The compositor scales frames to
+ * the output. A frame is only drawn once the compositor asked for one with
+ * a frame callback, so that animations pause while their output is hidden.
+ */
+struct wsbg_animator;
+
+/**
+ * Returns NULL if animated images can't be decoded.
+ */
+struct wsbg_animator *wsbg_animator_create(struct wsbg_state *state);
+void wsbg_animator_destroy(struct wsbg_animator *animator);
+/**
+ * Returns a file descriptor which becomes readable when frames are due.
+ */
+int wsbg_animator_get_fd(struct wsbg_animator *animator);
+/**
+ * Returns a file descriptor which becomes readable when an image was
+ * parsed.
+ */
+int wsbg_animator_get_load_fd(struct wsbg_animator *animator);
+/**
+ * Animates the image of the visible config of `output`, whose buffers of
+ * `width`x`height` pixels were just shown, if it is animated, once it is
+ * parsed. An animation of the same image keeps playing on the new buffers,
+ * while one of another image is replaced.
+ */
+void wsbg_animator_start(struct wsbg_animator *animator,
+		struct wsbg_output *output, int32_t width, int32_t height);
+/**
+ * Stops animating `output`, before its config changes or its surfaces are
+ * destroyed. Frames still shown are freed once the compositor releases
+ * them.
+ */
+void wsbg_animator_stop(struct wsbg_animator *animator,
+		struct wsbg_output *output);
+/**
+ * Stops animating `image` and drops what was parsed of it, after its file
+ * changed.
+ */
+void wsbg_animator_forget(struct wsbg_animator *animator,
+		struct wsbg_image *image);
+/**
+ * Draws the frames which are due, and starts playing the images which
+ * were parsed.
+ */
+void wsbg_animator_dispatch(struct wsbg_animator *animator);
+
+#endif
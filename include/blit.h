@@ -0,0 +1,34 @@
+#ifndef _WSBG_BLIT_H
+#define _WSBG_BLIT_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Kernels drawing an image at 1:1 scale and a whole pixel offset, which
+ * skip the filtering and transform of a pixman composite. With `stream`,
+ * pixels written to `dest` bypass the CPU caches where supported, which
+ * pays off when the whole destination doesn't fit in them.
+ */
+
+/**
+ * Fills `count` boxes of `dest` with `color`.
+ */
+void blit_fill(pixman_image_t *dest, const pixman_color_t *color,
+		const pixman_box32_t *boxes, int count, bool stream);
+/**
+ * Copies the `width`x`height` rectangle at (`x`, `y`) in `source` to
+ * (`dest_x`, `dest_y`) in `dest`. The rectangle must lie inside both.
+ */
+void blit_copy(pixman_image_t *dest, int32_t dest_x, int32_t dest_y,
+		pixman_image_t *source, int32_t x, int32_t y,
+		int32_t width, int32_t height, bool stream);
+/**
+ * Covers all of `dest` with copies of `source`, such that its top left
+ * pixel shows pixel (`x`, `y`) of `source`, wrapped around its edges.
+ */
+void blit_tile(pixman_image_t *dest, pixman_image_t *source,
+		int32_t x, int32_t y, bool stream);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _WSBG_BUFFER_CACHE_H
+#define _WSBG_BUFFER_CACHE_H
+
+#include "state.h"
+
+/**
+ * The buffer cache, a hash table of buffers keyed on what makes up their
+ * contents. Used by buffer.c, which serializes all calls with its lock,
+ * and by the benchmarks.
+ */
+
+/**
+ * Returns a new reference to the cached buffer matching `key`, or NULL.
+ * Sets the hash of `key`.
+ */
+struct wsbg_buffer *buffer_cache_find(struct wsbg_buffer *key);
+/**
+ * Adds `buffer` to the cache, with its hash already set.
+ */
+void buffer_cache_insert(struct wsbg_buffer *buffer);
+/**
+ * Removes `buffer` from the cache, and frees the table once it's empty.
+ */
+void buffer_cache_remove(struct wsbg_buffer *buffer);
+/**
+ * Removes the buffers of `image` from the cache, which leaves them to be
+ * released as usual.
+ */
+void buffer_cache_forget(struct wsbg_image *image);
+
+#endif
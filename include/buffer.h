@@ -1,13 +1,107 @@
 #ifndef _WSBG_BUFFER_H
 #define _WSBG_BUFFER_H
+#include <stdatomic.h>
 #include <stdint.h>
 #include "state.h"
 
+/**
+ * Returns a referenced buffer for `config` at the given size, rendering it
+ * unless a matching one exists. Gives up and returns NULL once `cancel`
+ * is set. Called from the render thread.
+ *
+ * With compositor scaling, the buffer may hold the whole image instead,
+ * and `source` is set to the part of it to show.
+ *
+ * If the image leaves most of a surface of `surface_width`x`surface_height`
+ * to the background color, and subsurfaces are available, the buffer only
+ * covers the image, and `box` is set to the part of the surface it covers.
+ *
+ * With `progressive`, an image which isn't cached with the filter of
+ * `config` is scaled with the fast filter instead, and `refine` is set.
+ */
 struct wsbg_buffer *get_wsbg_buffer(
 		struct wsbg_config *config,
 		struct wsbg_state *state,
-		int32_t width, int32_t height);
+		int32_t width, int32_t height,
+		int32_t surface_width, int32_t surface_height,
+		struct wsbg_source *source,
+		struct wsbg_box *box,
+		bool progressive, bool *refine,
+		const atomic_bool *cancel);
+
+/**
+ * Returns a referenced buffer of a single pixel of `color`. Called from the
+ * render thread.
+ */
+struct wsbg_buffer *get_wsbg_color_buffer(
+		struct wsbg_state *state,
+		struct wsbg_color color);
+
+/**
+ * Returns `upright`, whose reference is taken over, with its contents
+ * turned for the buffer transform `rotation`, WL_OUTPUT_TRANSFORM_90 or
+ * WL_OUTPUT_TRANSFORM_270, so that outputs rotated that way show it
+ * without turning it. A buffer turned the other way is returned instead
+ * if cached, and `upright` itself if it can't be turned. Called from the
+ * render thread.
+ */
+struct wsbg_buffer *get_wsbg_rotated_buffer(struct wsbg_state *state,
+		struct wsbg_buffer *upright, uint32_t rotation);
 
 void release_wsbg_buffer(struct wsbg_buffer *buffer);
 
+/**
+ * Removes the buffers of `image` from the cache, so that they are rendered
+ * again. Buffers still in use stay valid until they are released.
+ */
+void forget_wsbg_image_buffers(struct wsbg_image *image);
+
+/**
+ * Loads `image` like load_image, through the disk cache if there is one.
+ * May be called from any thread, for images no other thread uses.
+ */
+bool load_wsbg_image(struct wsbg_state *state, struct wsbg_image *image,
+		struct wsbg_color background, int scaled_width, int scaled_height);
+
+/**
+ * Gets the size the reducible `image` is decoded at to be rendered in
+ * `mode` at `position` into buffers of `width`x`height` pixels, or its full
+ * size if that isn't known.
+ */
+void get_wsbg_reduced_size(struct wsbg_state *state,
+		struct wsbg_image *image,
+		enum background_mode mode, struct wsbg_size position,
+		int32_t width, int32_t height,
+		int *scaled_width, int *scaled_height);
+
+/**
+ * Returns whether the opaque `image`, whose size is known, is decoded
+ * straight into buffers of `width`x`height` pixels showing it in `mode` at
+ * `position`, as it's drawn whole and unscaled, so it needn't be decoded
+ * ahead.
+ */
+bool is_wsbg_image_decoded_directly(struct wsbg_state *state,
+		struct wsbg_image *image,
+		enum background_mode mode, struct wsbg_size position,
+		int32_t width, int32_t height);
+
+/**
+ * Returns the shared memory held by all buffers, in bytes.
+ */
+size_t get_wsbg_buffer_memory(void);
+
+/**
+ * Parses the name of a pixel format supported for image buffers into
+ * its wl_shm format.
+ */
+bool parse_format(const char *str, uint32_t *format);
+const char *get_format_name(uint32_t format);
+
+bool parse_filter(const char *str, enum wsbg_filter *filter);
+
+/**
+ * Frees the cached filter kernels. Called from the render thread.
+ */
+void unload_wsbg_filters(void);
+
 #endif
@@ -0,0 +1,59 @@
+#ifndef _WSBG_DISK_CACHE_H
+#define _WSBG_DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "shm.h"
+#include "state.h"
+
+/**
+ * Keeps rendered image buffers and decoded images in files under
+ * $XDG_CACHE_HOME/wsbg, so that a restart doesn't decode and composite them
+ * again. Files are keyed on the image file and everything else that makes
+ * up their contents, written atomically, and removed least recently used
+ * first beyond a size limit.
+ * Safe to use from several threads at once.
+ */
+struct wsbg_disk_cache;
+
+/**
+ * Opens the cache directory, creating it if needed. Returns NULL on failure.
+ */
+struct wsbg_disk_cache *wsbg_disk_cache_create(size_t max_size);
+void wsbg_disk_cache_destroy(struct wsbg_disk_cache *cache);
+/**
+ * Sets the size of `image`, and whether it's opaque, as found when it was
+ * last decoded, so that rendering a cached buffer doesn't need decoding.
+ */
+bool wsbg_disk_cache_load_info(struct wsbg_disk_cache *cache,
+		struct wsbg_image *image, bool *opaque);
+void wsbg_disk_cache_store_info(struct wsbg_disk_cache *cache,
+		const struct wsbg_image *image);
+/**
+ * Maps the decoded pixels of `image`, as blended with `background`, as its
+ * surface, without decoding it.
+ */
+bool wsbg_disk_cache_load_image(struct wsbg_disk_cache *cache,
+		struct wsbg_image *image, struct wsbg_color background);
+/**
+ * Stores the decoded pixels of `image` as a raw image file.
+ */
+bool wsbg_disk_cache_store_image(struct wsbg_disk_cache *cache,
+		const struct wsbg_image *image);
+/**
+ * Looks up the buffer described by `key`. On a hit, its pixels are read
+ * into a new block of `shm`, which is returned, and `*buffer` and `*size`
+ * are set to a buffer of it and the size of its pixels.
+ */
+struct wsbg_shm_block *wsbg_disk_cache_load(struct wsbg_disk_cache *cache,
+		struct wsbg_shm *shm, const struct wsbg_buffer *key,
+		struct wl_buffer **buffer, size_t *size);
+/**
+ * Stores the pixels of the buffer described by `key`.
+ */
+void wsbg_disk_cache_store(struct wsbg_disk_cache *cache,
+		const struct wsbg_buffer *key, const void *data, int32_t stride);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _WSBG_DOWNSCALE_H
+#define _WSBG_DOWNSCALE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "state.h"
+
+/**
+ * Shrinks an image by averaging all image pixels each buffer pixel covers,
+ * placed by the same transform as a pixman composite. Where the image
+ * doesn't cover a buffer pixel, the background makes up the difference.
+ * Set up once per buffer, and then shared read-only by all its bands.
+ */
+struct downscale {
+	int32_t width;
+	int32_t source_width, source_height;
+	int64_t x, y, scale_x, scale_y;  // of the transform
+	uint32_t background;  // x8r8g8b8
+
+	// Image columns covered by each buffer column, and their weights
+	int32_t *columns, *counts, *offsets;
+	uint16_t *weights;
+	int32_t span_x, span_width;  // image columns covered by any of them
+	int32_t count_max_y;
+
+	// 2 or 4 when each buffer pixel covers a whole block of that size
+	int ratio;
+};
+
+/**
+ * Prepares shrinking an image of `source_width`x`source_height` into a
+ * buffer of `width`x`height` with `transform`, which must not enlarge it.
+ * Returns false on failure.
+ */
+bool downscale_init(struct downscale *downscale,
+		int32_t width, int32_t height,
+		const struct wsbg_image_transform *transform,
+		int32_t source_width, int32_t source_height,
+		uint32_t background);
+void downscale_finish(struct downscale *downscale);
+/**
+ * Draws the rows of `dest`, which start at row `y` of the buffer, from
+ * the untransformed `source`.
+ */
+void downscale_band(const struct downscale *downscale,
+		pixman_image_t *dest, pixman_image_t *source, int32_t y);
+
+#endif
@@ -3,6 +3,23 @@
 #include <stdint.h>
 #include "state.h"
 
+#define WSBG_RAW_MAGIC "wsbgraw"
+#define WSBG_RAW_VERSION 1
+
+/**
+ * Header of raw image files, which hold decoded pixels to be mapped as they
+ * are, without decoding. Pixels are opaque, in a 32-bit pixman format in host
+ * byte order, and start at `offset`, which leaves room for other data after
+ * the header. All fields are in host byte order.
+ */
+struct wsbg_raw_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t offset;
+	int32_t width, height, stride;
+	uint32_t format;  // pixman_format_code_t
+};
+
 bool parse_mode(
 		const char *str,
 		enum background_mode *mode,
@@ -20,8 +37,30 @@ void get_wsbg_image_transform(
 		struct wsbg_image_transform *transform,
 		bool *covered);
 
+/**
+ * Returns whether load_image would keep the surface `image` has.
+ */
+bool is_image_loaded(const struct wsbg_image *image,
+		struct wsbg_color background, int scaled_width, int scaled_height);
 bool load_image(struct wsbg_image *image,
 		struct wsbg_color background, int scaled_width, int scaled_height);
+/**
+ * Decodes `image`, whose size is known, straight into `dest` as rows of
+ * xrgb8888 `dest_stride` apart, without loading it. Returns false if it
+ * can't be decoded that way, such as when it's transparent, so that it's
+ * loaded instead.
+ */
+bool decode_image(struct wsbg_image *image, void *dest, int32_t dest_stride);
 void unload_image(struct wsbg_image *image);
+/**
+ * Returns the memory held by the decoded pixels and mipmaps of `image`.
+ */
+size_t get_image_memory(const struct wsbg_image *image);
+/**
+ * Maps the pixels of the raw image file `fd` as the surface of `image`, or
+ * copies them with `copy`, for files which may be changed in place rather
+ * than replaced. Returns false if it isn't a valid raw image file.
+ */
+bool map_raw_image(struct wsbg_image *image, int fd, bool copy);
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef _WSBG_PRELOAD_H
+#define _WSBG_PRELOAD_H
+
+#include <stdbool.h>
+#include "state.h"
+
+/**
+ * Decodes images ahead of the render thread, several at a time on a pool
+ * of its own, so that starting up doesn't decode them one after another.
+ * The render thread claims each image before using it, which waits for it
+ * to be decoded, or takes it over if decoding it hasn't started yet.
+ */
+struct wsbg_preloader;
+
+/**
+ * An image to decode, blended with `background`. Reducible images are
+ * decoded at the size the first queued job showing them needs, in `mode`
+ * at `position` into buffers of `width`x`height` pixels, or at full size
+ * if no job shows them yet.
+ */
+struct wsbg_preload_item {
+	struct wsbg_image *image;
+	struct wsbg_color background;
+	enum background_mode mode;
+	struct wsbg_size position;
+	int32_t width, height;  // 0 if no job shows the image
+};
+
+/**
+ * Starts decoding `count` images, in order. Takes ownership of `items`.
+ */
+struct wsbg_preloader *wsbg_preloader_create(struct wsbg_state *state,
+		struct wsbg_preload_item *items, unsigned count);
+/**
+ * Skips the images which haven't been started yet, waits for the rest,
+ * and frees the preloader.
+ */
+void wsbg_preloader_destroy(struct wsbg_preloader *preloader);
+/**
+ * Makes sure the preloader no longer uses `image`, so that the caller may.
+ */
+void wsbg_preloader_claim(struct wsbg_preloader *preloader,
+		struct wsbg_image *image);
+/**
+ * Returns whether the preloader may still use `image`.
+ */
+bool wsbg_preloader_is_busy(struct wsbg_preloader *preloader,
+		struct wsbg_image *image);
+
+#endif
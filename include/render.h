@@ -0,0 +1,88 @@
+#ifndef _WSBG_RENDER_H
+#define _WSBG_RENDER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "state.h"
+
+/**
+ * A request to render the buffer of a config, handled by the render thread.
+ * `output` and `config` are set to NULL when the job is cancelled.
+ */
+struct wsbg_render_job {
+	struct wsbg_output *output;
+	struct wsbg_config *config;
+	struct wsbg_config params;  // copy read by the render thread
+	int32_t width, height;
+	int32_t surface_width, surface_height;
+	uint32_t rotation;  // buffer transform the result is turned for, if set
+	int priority;  // lower values are rendered first
+	bool refine;  // replaces a fast progressive render, after other jobs
+	atomic_bool cancelled;
+	struct wsbg_buffer *buffer;  // result, NULL on failure
+	struct wsbg_source source;
+	struct wsbg_box box;
+	struct wsbg_buffer *background;  // shown around `box`, if set
+	struct wl_list link;
+};
+
+typedef void (*wsbg_render_done_func_t)(struct wsbg_render_job *job, void *data);
+
+/**
+ * Starts the render thread. Decoding and compositing happen on this thread
+ * (and its worker pool) at a lower priority than the event loop. Once the
+ * first jobs arrive, all images are decoded at once on another pool, those
+ * of the first jobs first.
+ *
+ * In progressive mode, priority 0 jobs which need scaling are first done
+ * with the fast filter, and queued again to be refined.
+ */
+struct wsbg_renderer *wsbg_renderer_create(struct wsbg_state *state);
+/**
+ * Stops the render thread and releases all pending results.
+ */
+void wsbg_renderer_destroy(struct wsbg_renderer *renderer);
+/**
+ * Returns a file descriptor which becomes readable when jobs are done.
+ */
+int wsbg_renderer_get_fd(struct wsbg_renderer *renderer);
+/**
+ * Queues rendering `config` at the given buffer size, for a surface of the
+ * given size, turned for the buffer transform `rotation` if set. A queued
+ * job of the same config is updated to its current state and size instead,
+ * and an in-flight one is kept if its size matches. A job with priority 0
+ * supersedes the in-flight priority 0 job of another config on the same
+ * output.
+ */
+void wsbg_renderer_submit(struct wsbg_renderer *renderer,
+		struct wsbg_output *output, struct wsbg_config *config,
+		int32_t width, int32_t height,
+		int32_t surface_width, int32_t surface_height, uint32_t rotation,
+		int priority);
+/**
+ * Cancels all jobs of `config`. Must be called before it is destroyed.
+ */
+void wsbg_renderer_cancel(struct wsbg_renderer *renderer,
+		struct wsbg_config *config);
+/**
+ * Lowers the priority of the queued job of `config`, if any, to `priority`,
+ * such as once it is no longer shown.
+ */
+void wsbg_renderer_demote(struct wsbg_renderer *renderer,
+		struct wsbg_config *config, int priority);
+/**
+ * Reloads `image` from its file before rendering anything else, and drops
+ * results rendered from the old file. Configs showing it need submitting
+ * again.
+ */
+void wsbg_renderer_reload_image(struct wsbg_renderer *renderer,
+		struct wsbg_image *image);
+/**
+ * Calls `func` for every finished job and frees it afterwards. Results
+ * left in `job->buffer` and `job->background` are released.
+ */
+void wsbg_renderer_dispatch(struct wsbg_renderer *renderer,
+		wsbg_render_done_func_t func, void *data);
+
+#endif
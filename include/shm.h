@@ -0,0 +1,45 @@
+#ifndef _WSBG_SHM_H
+#define _WSBG_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+/**
+ * Sub-allocates buffers out of a few large shared memory pools, which grow
+ * as needed and recycle the space of freed buffers.
+ */
+struct wsbg_shm;
+
+struct wsbg_shm_block;
+
+/**
+ * Creates an allocator for `shm`. With `huge_pages`, large buffers are put
+ * in pools of their own backed by huge pages.
+ */
+struct wsbg_shm *wsbg_shm_create(struct wl_shm *shm, bool huge_pages);
+/**
+ * Destroys all pools. Blocks still allocated must not be used afterwards.
+ */
+void wsbg_shm_destroy(struct wsbg_shm *shm);
+/**
+ * Allocates a block of `height * stride` bytes and creates a buffer for it
+ * in `*buffer`. Returns NULL on failure.
+ *
+ * Growing a pool may move its mapping, so the data of blocks in it must be
+ * fetched again after an allocation. Only one thread may allocate.
+ */
+struct wsbg_shm_block *wsbg_shm_alloc(struct wsbg_shm *shm,
+		int32_t width, int32_t height, int32_t stride, uint32_t format,
+		struct wl_buffer **buffer);
+/**
+ * Returns the mapped memory of `block`.
+ */
+void *wsbg_shm_block_data(struct wsbg_shm_block *block);
+/**
+ * Returns the space of `block` to its pool. The buffer created for it must
+ * already be destroyed. May be called from any thread.
+ */
+void wsbg_shm_free(struct wsbg_shm_block *block);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _WSBG_SLIDESHOW_H
+#define _WSBG_SLIDESHOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "state.h"
+
+// Seconds between images of a slideshow, unless set
+#define WSBG_SLIDESHOW_INTERVAL 300
+
+/**
+ * Cycles through the images of a directory, in the order of their names.
+ * Only two images exist at a time, the current one and the next one, whose
+ * places swap at every transition, so that a slideshow costs as much
+ * memory as two images however large the directory is.
+ */
+struct wsbg_slideshow {
+	char *path;  // of the directory
+	unsigned interval;  // in seconds
+	char **files;
+	size_t count, index;  // of the current file
+	struct wsbg_image *current;
+	struct wsbg_image *next;  // NULL if there is a single file
+	int64_t deadline;  // of the next transition, in CLOCK_MONOTONIC ms
+	struct wl_list link;
+};
+
+/**
+ * Lists the images of the directory at `path`. Returns NULL if there are
+ * none.
+ */
+struct wsbg_slideshow *wsbg_slideshow_create(const char *path,
+		unsigned interval);
+/**
+ * Frees the slideshow and its images, which nothing may use anymore.
+ */
+void wsbg_slideshow_destroy(struct wsbg_slideshow *slideshow);
+/**
+ * Moves on to the next image, which becomes `current`. The old current
+ * image becomes `next`, and the returned path is the file it should be
+ * loaded from, or NULL if it already is.
+ */
+const char *wsbg_slideshow_advance(struct wsbg_slideshow *slideshow);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _WSBG_STATE_H
 #define _WSBG_STATE_H
 #include <pixman.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
@@ -12,6 +13,7 @@
 struct wsbg_state {
 	struct wl_display *display;
 	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
 	struct zwlr_layer_shell_v1 *layer_shell;
 	struct wp_viewporter *viewporter;
@@ -20,9 +22,31 @@ struct wsbg_state {
 	struct wl_list options;     // struct wsbg_option::link
 	struct wl_list outputs;     // struct wsbg_output::link
 	struct wl_list workspaces;  // struct wsbg_workspace::link
+	struct wl_list existing;    // struct wsbg_workspace::link
 	struct wl_list images;      // struct wsbg_image::link
-	struct wl_list colors;      // struct wsbg_buffer::link
+	struct wl_list slideshows;  // struct wsbg_slideshow::link
+	struct wsbg_renderer *renderer;
+	struct wsbg_animator *animator;  // NULL without gdk-pixbuf
+	struct wsbg_shm *pools;
+	struct wsbg_workers *workers;  // used by the render thread
+	struct wsbg_preloader *preloader;  // used by the render thread
+	struct wsbg_disk_cache *disk_cache;  // NULL if disabled
+	int slideshow_timer;  // timerfd of the next slideshow transition, or -1
+	unsigned threads;
+	size_t max_buffer_memory;  // 0 for no limit
+	size_t max_disk_cache;  // 0 for no disk cache
+	size_t max_image_memory;  // 0 to keep images only while rendering
+	uint64_t show_count;
+	unsigned evictions, rerenders;
+	// Decoded image use, by the render thread
+	uint64_t image_use_count;
+	unsigned image_loads, image_hits, image_evictions;
+	uint32_t format;  // enum wl_shm_format of image buffers
+	bool format_supported : 1;
+	bool progressive : 1;
 	bool exit_on_reload : 1;
+	bool huge_pages : 1;
+	bool compositor_scaling : 1;
 	bool exit : 1;
 };
 
@@ -38,6 +62,9 @@ struct wsbg_color {
 
 #define Q16 INT64_C(0x10000)
 
+// Number of halved copies kept of a decoded image
+#define WSBG_MIPMAP_LEVELS 8
+
 struct wsbg_size {
 	pixman_fixed_t x, y;
 };
@@ -52,26 +79,71 @@ struct wsbg_image_transform {
 		(a).scale_x == (b).scale_x && \
 		(a).scale_y == (b).scale_y)
 
+/**
+ * Part of a buffer the compositor scales to the output, or all of it
+ * if `width` is 0.
+ */
+struct wsbg_source {
+	wl_fixed_t x, y, width, height;
+};
+
+/**
+ * Part of the surface covered by a buffer which doesn't span the whole
+ * output, in surface coordinates, or nothing if `width` is 0.
+ */
+struct wsbg_box {
+	int32_t x, y, width, height;
+};
+
+enum wsbg_filter {
+	WSBG_FILTER_FAST,
+	WSBG_FILTER_GOOD,
+	WSBG_FILTER_BEST,
+	WSBG_FILTER_LANCZOS,
+};
+
+enum wsbg_preload {
+	WSBG_PRELOAD_NONE,
+	WSBG_PRELOAD_PENDING,  // queued to be decoded ahead of rendering
+	WSBG_PRELOAD_RUNNING,  // being decoded ahead of rendering
+};
+
 struct wsbg_image {
-	const char *path;
+	const char *_Atomic path;  // only changed on the main thread
 	struct wsbg_color background;
 	pixman_image_t *surface;
+	// Halved sizes of `surface`, built as they are needed
+	pixman_image_t *mipmaps[WSBG_MIPMAP_LEVELS];
 	int width, height;
 	bool is_scalable;
-	struct wl_list buffers;  // struct wsbg_buffer::link
+	bool is_reducible;  // decoded at a reduced size when shrunk
+	bool is_mapped;  // `surface` holds a raw image file, mapped or copied
+	bool is_directory;  // shown as a slideshow, never decoded itself
+	uint64_t last_used;  // image_use_count of the state when last used
+	enum wsbg_preload preload;  // protected by the lock of the preloader
 	struct wl_list link;
 };
 
 struct wsbg_buffer {
 	struct wl_buffer *buffer;
-	void *data;
+	// NULL for single-pixel buffers
+	struct wsbg_shm_block *block;
 	size_t size;
 	size_t ref_count;
+
+	// Cache key, with all but `background` unset for color buffers
+	struct wsbg_image *image;
 	int32_t width, height;
+	uint32_t format;
 	struct wsbg_image_transform transform;
 	struct wsbg_color background;
 	bool repeat;
-	struct wl_list link;
+	enum wsbg_filter filter;
+	// enum wl_output_transform applied to the contents, whose size is
+	// swapped from `width` and `height` when rotated by 90 degrees
+	uint32_t rotation;
+	uint32_t hash;  // of the key
+	struct wl_list link;  // in a bucket of the buffer cache
 };
 
 enum wsbg_option_type {
@@ -81,6 +153,8 @@ enum wsbg_option_type {
 	WSBG_IMAGE,
 	WSBG_MODE,
 	WSBG_POSITION,
+	WSBG_FILTER,
+	WSBG_INTERVAL,
 };
 
 enum background_mode {
@@ -101,6 +175,8 @@ struct wsbg_option {
 		struct wsbg_image *image;
 		enum background_mode mode;
 		struct wsbg_size size;
+		enum wsbg_filter filter;
+		unsigned interval;
 	} value;
 	struct wl_list link;
 };
@@ -111,7 +187,21 @@ struct wsbg_config {
 	struct wsbg_size position;
 	struct wsbg_color color;
 	struct wsbg_image *image;
+	enum wsbg_filter filter;
+	unsigned interval;  // seconds between images of a slideshow
+	// Cycles `image` through a directory, or NULL
+	struct wsbg_slideshow *slideshow;
+	// Renders the next image of the slideshow ahead, not in any list
+	struct wsbg_config *next;
 	struct wsbg_buffer *buffer;
+	struct wsbg_source source;
+	// Color shown around a buffer which only covers `box`, or NULL
+	struct wsbg_buffer *background;
+	struct wsbg_box box;
+	uint64_t last_shown;  // state->show_count when last shown
+	bool dirty;  // buffer is missing or stale
+	uint64_t evicted_at;  // state->show_count when last evicted
+	bool evicted;  // buffer was released to stay within the budget
 	struct wl_list link;
 };
 
@@ -127,12 +217,17 @@ struct wsbg_output {
 	struct wl_list configs;  // struct wsbg_config::link
 
 	struct wl_surface *surface;
+	struct wsbg_source source;  // of the attached buffer
+	// Shows the image over a background color, if it doesn't fill the output
+	struct wl_surface *image_surface;
+	struct wl_subsurface *image_subsurface;
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct wp_fractional_scale_v1 *fractional_scale;
 
 	uint32_t width, height;
 	uint32_t scale_120;
 	int32_t mode_width, mode_height;
+	int32_t transform;  // enum wl_output_transform
 	bool configured, buffer_change, config_change;
 
 	struct wl_list link;
@@ -0,0 +1,31 @@
+#ifndef _WSBG_WATCH_H
+#define _WSBG_WATCH_H
+
+#include <wayland-client.h>
+#include "state.h"
+
+/**
+ * Watches the files of images with inotify, along with their directories,
+ * so that files replaced by renaming another file over them are noticed
+ * too. Only finished writes count as changes, and removed files don't.
+ */
+struct wsbg_watcher;
+
+typedef void (*wsbg_watch_func_t)(struct wsbg_image *image, void *data);
+
+/**
+ * Starts watching every image of `images`. Returns NULL on failure.
+ */
+struct wsbg_watcher *wsbg_watcher_create(struct wl_list *images);
+void wsbg_watcher_destroy(struct wsbg_watcher *watcher);
+/**
+ * Returns a file descriptor which becomes readable when files change.
+ */
+int wsbg_watcher_get_fd(struct wsbg_watcher *watcher);
+/**
+ * Calls `func` once for every image whose file changed since the last call.
+ */
+void wsbg_watcher_dispatch(struct wsbg_watcher *watcher,
+		wsbg_watch_func_t func, void *data);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _WSBG_WORKERS_H
+#define _WSBG_WORKERS_H
+
+#include <stdbool.h>
+
+/**
+ * A small pool of threads which run the iterations of a parallel loop.
+ */
+struct wsbg_workers;
+
+typedef void (*wsbg_workers_func_t)(void *data, unsigned index);
+
+/**
+ * Returns the number of CPUs this process may run on.
+ */
+unsigned wsbg_workers_default_count(void);
+/**
+ * Creates a pool running loops on `count` threads, including the caller.
+ * A count of 0 or 1 runs every loop on the calling thread.
+ */
+struct wsbg_workers *wsbg_workers_create(unsigned count);
+/**
+ * Stops and joins the threads and frees the pool.
+ */
+void wsbg_workers_destroy(struct wsbg_workers *workers);
+/**
+ * Returns the number of threads loops are run on, including the caller.
+ */
+unsigned wsbg_workers_count(struct wsbg_workers *workers);
+/**
+ * Calls `func(data, index)` for each index in [0, count), spread over the
+ * pool and the calling thread. Returns once every call has returned.
+ * Only one loop may run on a pool at a time.
+ */
+void wsbg_workers_run(struct wsbg_workers *workers,
+		wsbg_workers_func_t func, void *data, unsigned count);
+
+#endif
@@ -2,19 +2,31 @@
 #include <assert.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 #include <wayland-client.h>
+#include "animation.h"
 #include "buffer.h"
+#include "disk-cache.h"
 #include "image.h"
 #include "json.h"
 #include "log.h"
 #include "state.h"
+#include "render.h"
+#include "shm.h"
+#include "slideshow.h"
 #include "sway-ipc.h"
+#include "watch.h"
+#include "workers.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
 #include "single-pixel-buffer-v1-client-protocol.h"
@@ -22,6 +34,28 @@
 const struct wsbg_color default_color = {
 	.r = 0x00, .b = 0x00, .g = 0x00, .a = 0xFF };
 
+static bool parse_size(const char *str, size_t *size) {
+	char *end;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (end == str || errno || !isdigit((unsigned char)*str)) {
+		return false;
+	}
+	unsigned shift = 0;
+	switch (*end) {
+	case 'G': shift += 10; // fallthrough
+	case 'M': shift += 10; // fallthrough
+	case 'K': shift += 10;
+		++end;
+		break;
+	}
+	if (*end != '\0' || value > (SIZE_MAX >> shift)) {
+		return false;
+	}
+	*size = (size_t)value << shift;
+	return true;
+}
+
 static bool parse_color(const char *str, struct wsbg_color *color) {
 	int len = strlen(str);
 	if (len == 7 && str[0] == '#') {
@@ -51,46 +85,173 @@ static bool parse_color(const char *str, struct wsbg_color *color) {
 	return true;
 }
 
-static void render_buffer(struct wsbg_output *output) {
-	if (!output->config->buffer) {
+static struct wp_viewport *get_viewport(struct wsbg_output *output) {
+	struct wp_viewport *viewport = wp_viewporter_get_viewport(
+			output->state->viewporter, output->surface);
+	wp_viewport_set_destination(viewport, output->width, output->height);
+	if (output->source.width) {
+		wp_viewport_set_source(viewport,
+				output->source.x, output->source.y,
+				output->source.width, output->source.height);
+	}
+	return viewport;
+}
+
+/**
+ * Attaches the image of a letterboxed config to the subsurface, or detaches
+ * it otherwise. Takes effect with the next commit of the output surface.
+ */
+static void render_image_buffer(struct wsbg_output *output) {
+	struct wsbg_config *config = output->config;
+	if (!config->background) {
+		wl_surface_attach(output->image_surface, NULL, 0, 0);
+		wl_surface_commit(output->image_surface);
 		return;
 	}
 
-	wl_surface_attach(output->surface, output->config->buffer->buffer, 0, 0);
-	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_attach(output->image_surface, config->buffer->buffer, 0, 0);
+	wl_surface_set_buffer_transform(output->image_surface,
+			config->buffer->rotation);
+	wl_surface_damage_buffer(output->image_surface,
+			0, 0, INT32_MAX, INT32_MAX);
+	wl_subsurface_set_position(output->image_subsurface,
+			config->box.x, config->box.y);
 
 	struct wp_viewport *viewport = wp_viewporter_get_viewport(
-			output->state->viewporter, output->surface);
-	wp_viewport_set_destination(viewport, output->width, output->height);
+			output->state->viewporter, output->image_surface);
+	wp_viewport_set_destination(viewport,
+			config->box.width, config->box.height);
 
-	wl_surface_commit(output->surface);
+	wl_surface_commit(output->image_surface);
 
 	wp_viewport_destroy(viewport);
 }
 
-static void render_frame(struct wsbg_output *output,
-		struct wsbg_config *config) {
-	int32_t width, height;
+static void get_buffer_size(struct wsbg_output *output,
+		int32_t *width, int32_t *height) {
 	if (output->fractional_scale) {
-		width = (output->width * output->scale_120 + 60) / 120;
-		height = (output->height * output->scale_120 + 60) / 120;
+		*width = (output->width * output->scale_120 + 60) / 120;
+		*height = (output->height * output->scale_120 + 60) / 120;
+	} else if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+		// Buffers are rendered upright, so outputs rotated by 180 degrees
+		// share a buffer with unrotated ones
+		*width = output->mode_height;
+		*height = output->mode_width;
 	} else {
-		// Rotate buffer to match output
-		if ((output->mode_width < output->mode_height) ==
-				(output->width < output->height)) {
-			width = output->mode_width;
-			height = output->mode_height;
-		} else {
-			width = output->mode_height;
-			height = output->mode_width;
+		*width = output->mode_width;
+		*height = output->mode_height;
+	}
+}
+
+/**
+ * Gets the buffer transform buffers of `output` are turned for after
+ * rendering, if any. Those of outputs rotated by 90 or 270 degrees are
+ * turned to the orientation of the panel, so that the compositor needn't.
+ */
+static uint32_t get_buffer_rotation(struct wsbg_output *output) {
+	if (!(output->transform & WL_OUTPUT_TRANSFORM_90)) {
+		return WL_OUTPUT_TRANSFORM_NORMAL;
+	}
+	// Mirroring is left to the compositor
+	return output->transform & ~WL_OUTPUT_TRANSFORM_FLIPPED;
+}
+
+/**
+ * Shows the buffer of the visible config, and animates it from there if
+ * its image is animated. An animation of the same image keeps playing.
+ */
+static void render_buffer(struct wsbg_output *output) {
+	struct wsbg_config *config = output->config;
+	struct wsbg_animator *animator = output->state->animator;
+	if (!config->buffer) {
+		if (animator) {
+			wsbg_animator_stop(animator, output);
 		}
+		return;
+	}
+
+	if (output->image_subsurface) {
+		render_image_buffer(output);
 	}
 
 	struct wsbg_buffer *buffer =
-		get_wsbg_buffer(config, output->state, width, height);
+		config->background ? config->background : config->buffer;
+	wl_surface_attach(output->surface, buffer->buffer, 0, 0);
+	wl_surface_set_buffer_transform(output->surface, buffer->rotation);
+	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+	output->source = config->source;
 
+	struct wp_viewport *viewport = get_viewport(output);
+
+	wl_surface_commit(output->surface);
+
+	wp_viewport_destroy(viewport);
+
+	// A stale buffer is followed by a new one, which starts animating
+	if (animator && config->dirty) {
+		wsbg_animator_stop(animator, output);
+	} else if (animator) {
+		int32_t width, height;
+		get_buffer_size(output, &width, &height);
+		wsbg_animator_start(animator, output, width, height);
+	}
+}
+
+static void render_frame(struct wsbg_output *output,
+		struct wsbg_config *config, int priority) {
+	int32_t width, height;
+	get_buffer_size(output, &width, &height);
+	wsbg_renderer_submit(output->state->renderer, output, config,
+			width, height, output->width, output->height,
+			get_buffer_rotation(output), priority);
+}
+
+static void handle_render_done(struct wsbg_render_job *job, void *data) {
+	struct wsbg_output *output = job->output;
+	struct wsbg_config *config = job->config;
+
+	int32_t width, height;
+	get_buffer_size(output, &width, &height);
+	if (job->width != width || job->height != height ||
+			job->surface_width != (int32_t)output->width ||
+			job->surface_height != (int32_t)output->height) {
+		// The output changed size, and a newer job is on its way
+		return;
+	}
+
+	if (config->evicted) {
+		config->evicted = false;
+		++output->state->rerenders;
+		wsbg_log(LOG_DEBUG, "Re-rendered evicted buffer of workspace %s "
+				"(%u evictions, %u re-renders)",
+				config->workspace ? config->workspace : "*",
+				output->state->evictions, output->state->rerenders);
+	}
+
+	// The old buffers are released after the new ones replace them on the
+	// surface, so that their memory isn't reused while still shown
+	struct wsbg_buffer *old_buffer = config->buffer;
+	struct wsbg_buffer *old_background = config->background;
+	config->buffer = job->buffer;
+	config->source = job->source;
+	config->background = job->background;
+	config->box = job->box;
+	config->dirty = false;
+	job->buffer = NULL;
+	job->background = NULL;
+
+	if (config == output->config) {
+		render_buffer(output);
+	}
+	release_wsbg_buffer(old_buffer);
+	release_wsbg_buffer(old_background);
+}
+
+static void release_config_buffers(struct wsbg_config *config) {
 	release_wsbg_buffer(config->buffer);
-	config->buffer = buffer;
+	release_wsbg_buffer(config->background);
+	config->buffer = NULL;
+	config->background = NULL;
 }
 
 static void destroy_wsbg_image(struct wsbg_image *image) {
@@ -109,12 +270,17 @@ static void destroy_wsbg_option(struct wsbg_option *option) {
 	free(option);
 }
 
-static void destroy_wsbg_config(struct wsbg_config *config) {
+static void destroy_wsbg_config(struct wsbg_state *state,
+		struct wsbg_config *config) {
 	if (!config) {
 		return;
 	}
+	wsbg_renderer_cancel(state->renderer, config);
 	wl_list_remove(&config->link);
-	release_wsbg_buffer(config->buffer);
+	release_config_buffers(config);
+	if (config->next) {
+		destroy_wsbg_config(state, config->next);
+	}
 	free(config);
 }
 
@@ -123,6 +289,15 @@ static void destroy_wsbg_output(struct wsbg_output *output) {
 		return;
 	}
 	wl_list_remove(&output->link);
+	if (output->state->animator) {
+		wsbg_animator_stop(output->state->animator, output);
+	}
+	if (output->image_subsurface != NULL) {
+		wl_subsurface_destroy(output->image_subsurface);
+	}
+	if (output->image_surface != NULL) {
+		wl_surface_destroy(output->image_surface);
+	}
 	if (output->layer_surface != NULL) {
 		zwlr_layer_surface_v1_destroy(output->layer_surface);
 	}
@@ -135,7 +310,7 @@ static void destroy_wsbg_output(struct wsbg_output *output) {
 	wl_output_destroy(output->wl_output);
 	struct wsbg_config *config, *tmp_config;
 	wl_list_for_each_safe(config, tmp_config, &output->configs, link) {
-		destroy_wsbg_config(config);
+		destroy_wsbg_config(output->state, config);
 	}
 	free(output->name);
 	free(output->identifier);
@@ -152,20 +327,440 @@ static void destroy_wsbg_workspace(struct wsbg_workspace *workspace) {
 	free(workspace);
 }
 
+static struct wsbg_workspace *find_existing_workspace(
+		struct wsbg_state *state, const char *name) {
+	struct wsbg_workspace *workspace;
+	wl_list_for_each(workspace, &state->existing, link) {
+		if (strcmp(workspace->name, name) == 0) {
+			return workspace;
+		}
+	}
+	return NULL;
+}
+
+static void add_existing_workspace(struct wsbg_state *state, const char *name) {
+	if (find_existing_workspace(state, name)) {
+		return;
+	}
+	struct wsbg_workspace *workspace = calloc(1, sizeof *workspace);
+	if (!workspace || !(workspace->name = strdup(name))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		free(workspace);
+		return;
+	}
+	wl_list_insert(&state->existing, &workspace->link);
+}
+
+static void remove_existing_workspace(
+		struct wsbg_state *state, const char *name) {
+	destroy_wsbg_workspace(find_existing_workspace(state, name));
+
+	// Workspace is gone, so its buffers are only needed if it comes back
+	struct wsbg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		struct wsbg_config *config;
+		wl_list_for_each(config, &output->configs, link) {
+			if (config != output->config && config->workspace &&
+					strcmp(config->workspace, name) == 0) {
+				wsbg_renderer_cancel(state->renderer, config);
+				release_config_buffers(config);
+				config->dirty = true;
+			}
+		}
+	}
+}
+
+/**
+ * Returns the number a workspace name starts with, like Sway, or -1.
+ */
+static long workspace_number(const char *name) {
+	if (!name || !isdigit((unsigned char)*name)) {
+		return -1;
+	}
+	errno = 0;
+	long number = strtol(name, NULL, 10);
+	return errno ? -1 : number;
+}
+
+/**
+ * Returns the config shown on `output` for workspace `number`, which falls
+ * back to the config without a workspace.
+ */
+static struct wsbg_config *find_numbered_config(struct wsbg_output *output,
+		long number) {
+	struct wsbg_config *config, *fallback = NULL;
+	wl_list_for_each(config, &output->configs, link) {
+		if (!config->workspace) {
+			fallback = config;
+		} else if (workspace_number(config->workspace) == number) {
+			return config;
+		}
+	}
+	return fallback;
+}
+
+/**
+ * Returns whether `config` is likely to be shown next on `output`: it was
+ * shown last before the visible config, or its workspace is numbered next
+ * to the visible one. Switching workspaces mostly goes back and forth, or
+ * to a neighbour.
+ */
+static bool is_predicted(struct wsbg_output *output,
+		struct wsbg_config *config) {
+	if (!output->config || config == output->config) {
+		return false;
+	}
+
+	struct wsbg_config *previous = NULL, *needle;
+	wl_list_for_each(needle, &output->configs, link) {
+		if (needle != output->config && needle->last_shown &&
+				(!previous || needle->last_shown > previous->last_shown)) {
+			previous = needle;
+		}
+	}
+	if (config == previous) {
+		return true;
+	}
+
+	long number = workspace_number(output->config->workspace);
+	return number >= 0 && (find_numbered_config(output, number + 1) == config ||
+			(number > 0 && find_numbered_config(output, number - 1) == config));
+}
+
+/**
+ * Returns the order in which configs are rendered. The visible config comes
+ * first, then the configs likely to be shown next, then configs of other
+ * existing workspaces, then the fallback config. Other configs of
+ * workspaces that don't exist return -1 and are only rendered once they
+ * are shown.
+ */
+static int render_priority(struct wsbg_output *output,
+		struct wsbg_config *config) {
+	if (config == output->config) {
+		return 0;
+	} else if (is_predicted(output, config)) {
+		return 1;
+	} else if (!config->workspace) {
+		return 3;
+	} else if (find_existing_workspace(output->state, config->workspace)) {
+		return 2;
+	}
+	return -1;
+}
+
+static bool over_budget(struct wsbg_state *state) {
+	return state->max_buffer_memory &&
+		get_wsbg_buffer_memory() > state->max_buffer_memory;
+}
+
+/**
+ * Releases the buffers of hidden configs, least recently shown first,
+ * until all buffers fit in the memory budget. Configs likely to be shown
+ * next go last. Evicted configs are only rendered again once they are
+ * shown, or predicted again after a switch.
+ */
+static void evict_buffers(struct wsbg_state *state) {
+	while (over_budget(state)) {
+		struct wsbg_config *lru = NULL;
+		bool lru_predicted = false;
+		struct wsbg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			struct wsbg_config *config;
+			wl_list_for_each(config, &output->configs, link) {
+				if (config == output->config || !config->buffer) {
+					continue;
+				}
+				bool predicted = is_predicted(output, config);
+				if (!lru || (lru_predicted && !predicted) ||
+						(lru_predicted == predicted &&
+							config->last_shown < lru->last_shown)) {
+					lru = config;
+					lru_predicted = predicted;
+				}
+			}
+		}
+		if (!lru) {
+			break;
+		}
+
+		release_config_buffers(lru);
+		lru->dirty = true;
+		lru->evicted = true;
+		lru->evicted_at = state->show_count;
+		++state->evictions;
+		wsbg_log(LOG_DEBUG, "Evicted buffer of workspace %s "
+				"(%u evictions, %u re-renders)",
+				lru->workspace ? lru->workspace : "*",
+				state->evictions, state->rerenders);
+	}
+}
+
+/**
+ * Queues every dirty config which should be rendered. Visible configs are
+ * queued first, so that they supersede stale jobs of the same output.
+ * Hidden configs wait while buffers exceed the memory budget.
+ */
+static void submit_dirty_configs(struct wsbg_state *state) {
+	struct wsbg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->configured) {
+			continue;
+		}
+		if (output->config->dirty) {
+			render_frame(output, output->config, 0);
+		}
+		// Jobs queued while their config was shown would still go first
+		struct wsbg_config *config;
+		wl_list_for_each(config, &output->configs, link) {
+			if (config != output->config) {
+				int priority = render_priority(output, config);
+				wsbg_renderer_demote(state->renderer, config,
+						priority > 0 ? priority : INT_MAX);
+			}
+		}
+	}
+	if (over_budget(state)) {
+		return;
+	}
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->configured) {
+			continue;
+		}
+		struct wsbg_config *config;
+		wl_list_for_each(config, &output->configs, link) {
+			// Predicted configs get another chance after every switch, so
+			// that they can't evict each other over and over
+			int priority = render_priority(output, config);
+			bool evicted = config->evicted && !(priority == 1 &&
+					config->evicted_at < output->state->show_count);
+			if (config != output->config && config->dirty &&
+					!evicted && priority > 0) {
+				render_frame(output, config, priority);
+			}
+		}
+	}
+	// The next image of a slideshow is only needed once its time comes
+	wl_list_for_each(output, &state->outputs, link) {
+		struct wsbg_config *next = output->config->next;
+		if (output->configured && next && next->dirty) {
+			render_frame(output, next, 4);
+		}
+	}
+}
+
+/**
+ * Renders every config showing `image` again, after its file changed.
+ * Hidden configs drop their stale buffers, while visible ones keep showing
+ * theirs until the new ones are rendered, which happens first.
+ */
+static void handle_image_change(struct wsbg_image *image, void *data) {
+	struct wsbg_state *state = data;
+	wsbg_renderer_reload_image(state->renderer, image);
+	if (state->animator) {
+		wsbg_animator_forget(state->animator, image);
+	}
+
+	struct wsbg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		struct wsbg_config *config;
+		wl_list_for_each(config, &output->configs, link) {
+			if (config->image != image ||
+					config->mode == BACKGROUND_MODE_SOLID_COLOR) {
+				continue;
+			}
+			if (config != output->config) {
+				release_config_buffers(config);
+			}
+			config->dirty = true;
+		}
+	}
+}
+
+static int64_t get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Sets the slideshow timer to expire at the earliest transition, or
+ * disarms it if no slideshow has more than one image.
+ */
+static void arm_slideshow_timer(struct wsbg_state *state) {
+	if (state->slideshow_timer == -1) {
+		return;
+	}
+	int64_t deadline = -1;
+	struct wsbg_slideshow *slideshow;
+	wl_list_for_each(slideshow, &state->slideshows, link) {
+		if (slideshow->next &&
+				(deadline == -1 || slideshow->deadline < deadline)) {
+			deadline = slideshow->deadline;
+		}
+	}
+	struct itimerspec spec = {0};
+	if (deadline != -1) {
+		// A zero value would disarm the timer instead
+		spec.it_value.tv_sec = deadline / 1000;
+		spec.it_value.tv_nsec = deadline % 1000 * 1000000 + 1;
+	}
+	if (timerfd_settime(state->slideshow_timer, TFD_TIMER_ABSTIME,
+			&spec, NULL) == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to set slideshow timer");
+	}
+}
+
+/**
+ * Shows the new current image of the slideshow of `config`. If the next
+ * image was rendered ahead, its buffers are simply swapped in. Otherwise
+ * the visible config keeps showing the old image until the new one is
+ * rendered. `reloaded` tells whether the next image comes from another
+ * file than before.
+ */
+static void show_next_image(struct wsbg_output *output,
+		struct wsbg_config *config, bool reloaded) {
+	struct wsbg_state *state = output->state;
+	struct wsbg_config *next = config->next;
+	wsbg_renderer_cancel(state->renderer, config);
+	if (next) {
+		wsbg_renderer_cancel(state->renderer, next);
+	}
+	config->image = config->slideshow->current;
+	if (config->mode == BACKGROUND_MODE_SOLID_COLOR) {
+		return;
+	}
+
+	if (!next || !next->buffer || next->dirty) {
+		if (next) {
+			next->image = config->slideshow->next;
+			release_config_buffers(next);
+			next->dirty = true;
+		}
+		if (config != output->config) {
+			release_config_buffers(config);
+		}
+		config->dirty = true;
+		return;
+	}
+
+	// With two files, the old buffers show what comes next again
+	struct wsbg_config old = *config;
+	next->image = config->slideshow->next;
+	config->buffer = next->buffer;
+	config->source = next->source;
+	config->background = next->background;
+	config->box = next->box;
+	config->dirty = false;
+	config->evicted = false;
+	next->buffer = old.buffer;
+	next->source = old.source;
+	next->background = old.background;
+	next->box = old.box;
+	next->dirty = old.dirty || !old.buffer;
+
+	if (config == output->config && output->configured) {
+		render_buffer(output);
+	}
+	if (reloaded) {
+		release_config_buffers(next);
+		next->dirty = true;
+	}
+}
+
+/**
+ * Moves every slideshow whose time has come on to its next image, and
+ * starts loading the image after it.
+ */
+static void advance_slideshows(struct wsbg_state *state) {
+	int64_t now = get_time_ms();
+	struct wsbg_slideshow *slideshow;
+	wl_list_for_each(slideshow, &state->slideshows, link) {
+		if (!slideshow->next || slideshow->deadline > now) {
+			continue;
+		}
+		const char *path = wsbg_slideshow_advance(slideshow);
+		if (path) {
+			// Changed here, as other threads read it until the reload
+			slideshow->next->path = path;
+			wsbg_renderer_reload_image(state->renderer, slideshow->next);
+			if (state->animator) {
+				wsbg_animator_forget(state->animator, slideshow->next);
+			}
+		}
+
+		struct wsbg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			struct wsbg_config *config;
+			wl_list_for_each(config, &output->configs, link) {
+				if (config->slideshow == slideshow) {
+					show_next_image(output, config, path != NULL);
+				}
+			}
+		}
+
+		// Transitions missed while suspended aren't caught up on
+		int64_t interval = (int64_t)slideshow->interval * 1000;
+		slideshow->deadline += interval;
+		if (slideshow->deadline <= now) {
+			slideshow->deadline = now + interval;
+		}
+	}
+	arm_slideshow_timer(state);
+}
+
+/**
+ * Shows the directory of `config` as a slideshow, which configs of the
+ * same directory and interval share, so that they change images together.
+ */
+static void start_slideshow(struct wsbg_state *state,
+		struct wsbg_config *config) {
+	struct wsbg_slideshow *slideshow = NULL, *needle;
+	wl_list_for_each(needle, &state->slideshows, link) {
+		if (strcmp(needle->path, config->image->path) == 0 &&
+				needle->interval == config->interval) {
+			slideshow = needle;
+			break;
+		}
+	}
+	if (!slideshow) {
+		if (!(slideshow = wsbg_slideshow_create(
+				config->image->path, config->interval))) {
+			config->image = NULL;
+			return;
+		}
+		slideshow->deadline = get_time_ms() +
+			(int64_t)slideshow->interval * 1000;
+		wl_list_insert(state->slideshows.prev, &slideshow->link);
+		arm_slideshow_timer(state);
+	}
+
+	config->slideshow = slideshow;
+	config->image = slideshow->current;
+	if (!slideshow->next) {
+		return;
+	}
+	if (!(config->next = malloc(sizeof *config->next))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return;
+	}
+	*config->next = *config;
+	config->next->image = slideshow->next;
+	config->next->slideshow = NULL;
+	config->next->next = NULL;
+	config->next->buffer = NULL;
+	config->next->background = NULL;
+	config->next->dirty = true;
+	wl_list_init(&config->next->link);
+}
+
 static void layer_surface_configure(void *data,
 		struct zwlr_layer_surface_v1 *surface,
 		uint32_t serial, uint32_t width, uint32_t height) {
 	struct wsbg_output *output = data;
 	if (output->width != width || output->height != height) {
-		if (output->fractional_scale) {
-			if (output->width != width || output->height != height) {
-				output->buffer_change = true;
-			}
-		} else {
-			// Flag when output rotation changes
-			if ((width < height) != (output->width < output->height)) {
-				output->buffer_change = true;
-			}
+		// Letterboxed images are placed in surface coordinates
+		if (output->fractional_scale || output->image_subsurface) {
+			output->buffer_change = true;
 		}
 
 		output->width = width;
@@ -175,11 +770,8 @@ static void layer_surface_configure(void *data,
 			return;
 		}
 
-		struct wp_viewport *viewport = wp_viewporter_get_viewport(
-				output->state->viewporter, output->surface);
-
 		zwlr_layer_surface_v1_ack_configure(surface, serial);
-		wp_viewport_set_destination(viewport, width, height);
+		struct wp_viewport *viewport = get_viewport(output);
 		wl_surface_commit(output->surface);
 		output->configured = true;
 
@@ -215,10 +807,16 @@ static const struct wp_fractional_scale_v1_listener
 	.preferred_scale = output_preferred_scale,
 };
 
-static void output_geometry(void *data, struct wl_output *output, int32_t x,
+static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
 		int32_t y, int32_t width_mm, int32_t height_mm, int32_t subpixel,
 		const char *make, const char *model, int32_t transform) {
-	// Who cares
+	struct wsbg_output *output = data;
+	// Mirroring and 180 degree rotations keep the buffer size
+	if (!output->fractional_scale &&
+			((output->transform ^ transform) & WL_OUTPUT_TRANSFORM_90)) {
+		output->buffer_change = true;
+	}
+	output->transform = transform;
 }
 
 static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
@@ -243,6 +841,17 @@ static void create_layer_surface(struct wsbg_output *output) {
 		wl_compositor_create_region(output->state->compositor);
 	assert(input_region);
 	wl_surface_set_input_region(output->surface, input_region);
+
+	if (output->state->subcompositor) {
+		output->image_surface =
+			wl_compositor_create_surface(output->state->compositor);
+		assert(output->image_surface);
+		wl_surface_set_input_region(output->image_surface, input_region);
+		output->image_subsurface = wl_subcompositor_get_subsurface(
+				output->state->subcompositor,
+				output->image_surface, output->surface);
+		assert(output->image_subsurface);
+	}
 	wl_region_destroy(input_region);
 
 	if (output->state->fractional_scale_manager) {
@@ -291,10 +900,13 @@ static void output_scale(void *data, struct wl_output *wl_output,
 }
 
 static void configure_output(struct wsbg_output *output) {
+	if (output->state->animator) {
+		wsbg_animator_stop(output->state->animator, output);
+	}
 	while (output->configs.next != &output->configs) {
 		struct wsbg_config *config =
 				wl_container_of(output->configs.next, config, link);
-		destroy_wsbg_config(config);
+		destroy_wsbg_config(output->state, config);
 	}
 
 	output->buffer_change = true;
@@ -311,6 +923,9 @@ static void configure_output(struct wsbg_output *output) {
 		.color = default_color,
 		.mode = BACKGROUND_MODE_FILL,
 		.position = { .x = Q16 / 2, .y = Q16 / 2 },
+		.filter = WSBG_FILTER_BEST,
+		.interval = WSBG_SLIDESHOW_INTERVAL,
+		.dirty = true,
 	};
 	wl_list_insert(&configs, &default_config->link);
 	output->config = default_config;
@@ -394,11 +1009,26 @@ static void configure_output(struct wsbg_output *output) {
 				wl_list_for_each(config, &configs, link) {
 					config->position = option->value.size;
 				}
+			} else if (option->type == WSBG_FILTER) {
+				wl_list_for_each(config, &configs, link) {
+					config->filter = option->value.filter;
+				}
+			} else if (option->type == WSBG_INTERVAL) {
+				wl_list_for_each(config, &configs, link) {
+					config->interval = option->value.interval;
+				}
 			}
 		}
 		prev_type = option->type;
 	}
 	wl_list_insert_list(&output->configs, &configs);
+
+	struct wsbg_config *config;
+	wl_list_for_each(config, &output->configs, link) {
+		if (config->image && config->image->is_directory) {
+			start_slideshow(output->state, config);
+		}
+	}
 }
 
 static void output_name(void *data, struct wl_output *wl_output,
@@ -461,14 +1091,29 @@ static const struct wl_output_listener output_listener = {
 	.description = output_description,
 };
 
+static void shm_format(void *data, struct wl_shm *shm, uint32_t format) {
+	struct wsbg_state *state = data;
+	if (format == state->format) {
+		state->format_supported = true;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_format,
+};
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct wsbg_state *state = data;
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
 		state->compositor =
 			wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		state->subcompositor =
+			wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+		wl_shm_add_listener(state->shm, &shm_listener, state);
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
 		struct wsbg_output *output = calloc(1, sizeof(struct wsbg_output));
 		output->state = state;
@@ -554,12 +1199,22 @@ static void parse_command_line(int argc, char **argv,
 		struct wsbg_state *state) {
 	static struct option long_options[] = {
 		{"color", required_argument, NULL, 'c'},
+		{"compositor-scaling", no_argument, NULL, 'S'},
+		{"disk-cache", required_argument, NULL, 'D'},
+		{"filter", required_argument, NULL, 'Q'},
+		{"format", required_argument, NULL, 'F'},
 		{"help", no_argument, NULL, 'h'},
+		{"huge-pages", no_argument, NULL, 'H'},
 		{"image", required_argument, NULL, 'i'},
+		{"interval", required_argument, NULL, 'N'},
+		{"max-buffer-memory", required_argument, NULL, 'M'},
+		{"max-image-memory", required_argument, NULL, 'I'},
 		{"mode", required_argument, NULL, 'm'},
 		{"output", required_argument, NULL, 'o'},
 		{"position", required_argument, NULL, 'p'},
+		{"progressive", no_argument, NULL, 'P'},
 		{"exit-on-reload", no_argument, NULL, 'r'},
+		{"threads", required_argument, NULL, 'T'},
 		{"version", no_argument, NULL, 'v'},
 		{"workspace", required_argument, NULL, 'w'},
 		{0, 0, 0, 0}
@@ -569,12 +1224,27 @@ static void parse_command_line(int argc, char **argv,
 		"Usage: wsbg <options...>\n"
 		"\n"
 		"  -c, --color            Set the background color.\n"
+		"      --compositor-scaling\n"
+		"                         Let the compositor scale images.\n"
+		"      --disk-cache       Set the size of the cache of image buffers\n"
+		"                         kept on disk across restarts.\n"
+		"      --filter           Set the filter used to scale images.\n"
+		"      --format           Set the pixel format of image buffers.\n"
 		"  -h, --help             Show help message and quit.\n"
-		"  -i, --image            Set the image to display.\n"
+		"      --huge-pages       Put large buffers on huge pages.\n"
+		"  -i, --image            Set the image or directory of images to\n"
+		"                         display.\n"
+		"      --interval         Set the seconds between images of a directory.\n"
 		"  -m, --mode             Set the mode to use for the image.\n"
+		"      --max-buffer-memory\n"
+		"                         Set the memory budget of hidden buffers.\n"
+		"      --max-image-memory\n"
+		"                         Set the memory budget of decoded images.\n"
 		"  -o, --output           Set the output to operate on or * for all.\n"
 		"  -p, --position         Set the position of the image.\n"
+		"      --progressive      Show a quickly scaled image first.\n"
 		"  -r, --exit-on-reload   Exit when Sway config is reloaded.\n"
+		"      --threads          Set the number of threads to render with.\n"
 		"  -v, --version          Show the version number and quit.\n"
 		"  -w, --workspace        Set the workspace to operate on or * for all.\n"
 		"\n"
@@ -582,7 +1252,13 @@ static void parse_command_line(int argc, char **argv,
 		"  stretch, fit, fill, center, tile, or solid_color\n"
 		"\n"
 		"Background Positions:\n"
-		"  center, left, right, top, bottom, or (top|bottom)/(left|right)\n";
+		"  center, left, right, top, bottom, or (top|bottom)/(left|right)\n"
+		"\n"
+		"Filters:\n"
+		"  fast, good, best, or lanczos\n"
+		"\n"
+		"Pixel Formats:\n"
+		"  xrgb8888, rgb565, or xrgb2101010\n";
 
 	int c;
 	while (1) {
@@ -603,6 +1279,32 @@ static void parse_command_line(int argc, char **argv,
 			wsbg_option_new(state, WSBG_COLOR)->value.color = color;
 			break;
 		}
+		case 'S':  // compositor-scaling
+			state->compositor_scaling = true;
+			break;
+		case 'D':  // disk-cache
+			if (!parse_size(optarg, &state->max_disk_cache)) {
+				wsbg_log(LOG_ERROR, "Invalid disk cache size: %s", optarg);
+			}
+			break;
+		case 'Q':  // filter
+			{
+				enum wsbg_filter filter;
+				if (!parse_filter(optarg, &filter)) {
+					wsbg_log(LOG_ERROR, "Invalid filter: %s", optarg);
+					break;
+				}
+				wsbg_option_new(state, WSBG_FILTER)->value.filter = filter;
+			}
+			break;
+		case 'F':  // format
+			if (!parse_format(optarg, &state->format)) {
+				wsbg_log(LOG_ERROR, "Invalid format: %s", optarg);
+			}
+			break;
+		case 'H':  // huge-pages
+			state->huge_pages = true;
+			break;
 		case 'i': { // image
 			struct wsbg_image *im, *image = NULL;
 			wl_list_for_each(im, &state->images, link) {
@@ -614,12 +1316,24 @@ static void parse_command_line(int argc, char **argv,
 			if (!image) {
 				image = calloc(1, sizeof *image);
 				image->path = optarg;
-				wl_list_init(&image->buffers);
+				struct stat st;
+				image->is_directory =
+					stat(optarg, &st) == 0 && S_ISDIR(st.st_mode);
 				wl_list_insert(&state->images, &image->link);
 			}
 			wsbg_option_new(state, WSBG_IMAGE)->value.image = image;
 			break;
 		}
+		case 'N': { // interval
+			char *end;
+			long interval = strtol(optarg, &end, 10);
+			if (*end || end == optarg || interval < 1 || interval > INT32_MAX) {
+				wsbg_log(LOG_ERROR, "Invalid interval: %s", optarg);
+				break;
+			}
+			wsbg_option_new(state, WSBG_INTERVAL)->value.interval = interval;
+			break;
+		}
 		case 'm':  // mode
 			{
 				enum background_mode mode;
@@ -634,6 +1348,16 @@ static void parse_command_line(int argc, char **argv,
 					->value.size = position;
 			}
 			break;
+		case 'M':  // max-buffer-memory
+			if (!parse_size(optarg, &state->max_buffer_memory)) {
+				wsbg_log(LOG_ERROR, "Invalid memory size: %s", optarg);
+			}
+			break;
+		case 'I':  // max-image-memory
+			if (!parse_size(optarg, &state->max_image_memory)) {
+				wsbg_log(LOG_ERROR, "Invalid memory size: %s", optarg);
+			}
+			break;
 		case 'o':  // output
 			wsbg_option_select(state, WSBG_OUTPUT, optarg);
 			break;
@@ -648,9 +1372,24 @@ static void parse_command_line(int argc, char **argv,
 					->value.size = position;
 			}
 			break;
+		case 'P':  // progressive
+			state->progressive = true;
+			break;
 		case 'r':  // exit-on-reload
 			state->exit_on_reload = true;
 			break;
+		case 'T':  // threads
+			{
+				char *end;
+				long threads = strtol(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' ||
+						threads < 1 || threads > 256) {
+					wsbg_log(LOG_ERROR, "Invalid thread count: %s", optarg);
+					break;
+				}
+				state->threads = threads;
+			}
+			break;
 		case 'v':  // version
 			fprintf(stdout, "wsbg version " WSBG_VERSION "\n");
 			exit(EXIT_SUCCESS);
@@ -725,6 +1464,7 @@ struct wsbg_workspace *update_workspace(
 					break;
 				}
 			}
+			output->config->last_shown = ++state->show_count;
 			break;
 		}
 	}
@@ -780,6 +1520,9 @@ const char *handle_sway_workspaces(struct wsbg_state *state, char *json_buffer,
 				json_skip_key_value_pair(&s);
 			}
 		}
+		if (name) {
+			add_existing_workspace(state, name);
+		}
 		if (name && output && visible) {
 			struct wsbg_workspace *workspace = update_workspace(state, last, name, output);
 			if (!workspace) {
@@ -805,9 +1548,13 @@ const char *handle_sway_workspace_event(struct wsbg_state *state, char *buffer,
 		return s.err ? s.err : "Root is not an object";
 	}
 	char *name = NULL, *output = NULL;
-	bool update = false;
+	bool update = false, empty = false;
 	while (!json_end_object(&s)) {
 		if (json_key(&s, "change")) {
+			if (json_string(&s, "empty")) {
+				empty = true;
+				continue;
+			}
 			if (!(json_string(&s, "init") ||
 					json_string(&s, "focus") ||
 					json_string(&s, "move") ||
@@ -845,6 +1592,9 @@ const char *handle_sway_workspace_event(struct wsbg_state *state, char *buffer,
 	}
 	if (update && name && output) {
 		update_workspace(state, &state->workspaces, name, output);
+		add_existing_workspace(state, name);
+	} else if (empty && name) {
+		remove_existing_workspace(state, name);
 	}
 	return s.err;
 }
@@ -852,15 +1602,36 @@ const char *handle_sway_workspace_event(struct wsbg_state *state, char *buffer,
 int main(int argc, char **argv) {
 	wsbg_log_init(LOG_DEBUG);
 
-	struct wsbg_state state = {0};
+	struct wsbg_state state = { .format = WL_SHM_FORMAT_XRGB8888 };
 	wl_list_init(&state.options);
 	wl_list_init(&state.outputs);
 	wl_list_init(&state.workspaces);
+	wl_list_init(&state.existing);
 	wl_list_init(&state.images);
-	wl_list_init(&state.colors);
+	wl_list_init(&state.slideshows);
+	state.slideshow_timer = -1;
 
 	parse_command_line(argc, argv, &state);
 
+	// Slideshows are timed on their own descriptor, armed once they start
+	struct wsbg_image *image;
+	wl_list_for_each(image, &state.images, link) {
+		if (image->is_directory) {
+			state.slideshow_timer = timerfd_create(CLOCK_MONOTONIC,
+					TFD_CLOEXEC | TFD_NONBLOCK);
+			if (state.slideshow_timer == -1) {
+				wsbg_log_errno(LOG_ERROR, "Unable to create slideshow timer");
+			}
+			break;
+		}
+	}
+
+	if (state.threads == 0) {
+		state.threads = wsbg_workers_default_count();
+		if (state.threads > 4) {
+			state.threads = 4;
+		}
+	}
 
 	state.display = wl_display_connect(NULL);
 	if (!state.display) {
@@ -882,6 +1653,39 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	// Formats are announced once wl_shm is bound
+	if (state.format != WL_SHM_FORMAT_XRGB8888) {
+		if (wl_display_roundtrip(state.display) == -1) {
+			wsbg_log(LOG_ERROR, "wl_display_roundtrip failed");
+			return 1;
+		}
+		if (!state.format_supported) {
+			wsbg_log(LOG_ERROR, "Format %s is not supported by the "
+					"compositor, using xrgb8888",
+					get_format_name(state.format));
+			state.format = WL_SHM_FORMAT_XRGB8888;
+		}
+	}
+
+	// Without a cache directory, buffers are just rendered every time
+	if (state.max_disk_cache) {
+		state.disk_cache = wsbg_disk_cache_create(state.max_disk_cache);
+	}
+
+	// Created after the globals are bound, which the render thread uses
+	if (!(state.pools = wsbg_shm_create(state.shm, state.huge_pages)) ||
+			!(state.renderer = wsbg_renderer_create(&state))) {
+		return 1;
+	}
+
+	// Without gdk-pixbuf, animated images show their first frame
+	state.animator = wsbg_animator_create(&state);
+
+	// Without inotify, changed images are only loaded again on restart
+	struct wsbg_watcher *watcher = NULL;
+	if (!wl_list_empty(&state.images)) {
+		watcher = wsbg_watcher_create(&state.images);
+	}
 
 	struct sway_ipc_state sway_ipc_state;
 	sway_ipc_open(&sway_ipc_state);
@@ -895,7 +1699,14 @@ int main(int argc, char **argv) {
 
 	struct pollfd pfd[] = {
 		{ .fd = display_pfd.fd, .events = POLLIN },
-		{ .fd = sway_ipc_state.fd, .events = POLLIN }
+		{ .fd = sway_ipc_state.fd, .events = POLLIN },
+		{ .fd = wsbg_renderer_get_fd(state.renderer), .events = POLLIN },
+		{ .fd = watcher ? wsbg_watcher_get_fd(watcher) : -1, .events = POLLIN },
+		{ .fd = state.slideshow_timer, .events = POLLIN },
+		{ .fd = state.animator ? wsbg_animator_get_fd(state.animator) : -1,
+			.events = POLLIN },
+		{ .fd = state.animator ? wsbg_animator_get_load_fd(state.animator) : -1,
+			.events = POLLIN },
 	};
 
 	while (true) {
@@ -958,15 +1769,45 @@ int main(int argc, char **argv) {
 			}
 		}
 
+		if (pfd[2].revents & POLLIN) {
+			wsbg_renderer_dispatch(state.renderer, handle_render_done, NULL);
+		}
+
+		if (pfd[3].revents & POLLIN) {
+			wsbg_watcher_dispatch(watcher, handle_image_change, &state);
+		}
+
+		if (pfd[4].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(state.slideshow_timer, &expirations,
+					sizeof expirations) == -1 && errno != EAGAIN) {
+				wsbg_log_errno(LOG_ERROR, "Unable to read slideshow timer");
+			}
+			advance_slideshows(&state);
+		}
+
+		if ((pfd[5].revents | pfd[6].revents) & POLLIN) {
+			wsbg_animator_dispatch(state.animator);
+		}
+
 		struct wsbg_output *output;
 		wl_list_for_each(output, &state.outputs, link) {
 			if (!output->configured) {
 				continue;
 			}
 			if (output->buffer_change) {
+				// Stale buffers of hidden configs are dropped rather than
+				// kept around until their turn to be re-rendered
 				struct wsbg_config *config;
 				wl_list_for_each(config, &output->configs, link) {
-					render_frame(output, config);
+					if (config != output->config) {
+						release_config_buffers(config);
+					}
+					config->dirty = true;
+					if (config->next) {
+						release_config_buffers(config->next);
+						config->next->dirty = true;
+					}
 				}
 			}
 			if (output->buffer_change || output->config_change) {
@@ -976,21 +1817,31 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		struct wsbg_image *image;
-		wl_list_for_each(image, &state.images, link) {
-			unload_image(image);
-		}
+		evict_buffers(&state);
+		submit_dirty_configs(&state);
 	}
 
 cancel_read_and_exit:
 	wl_display_cancel_read(state.display);
 exit:
 	sway_ipc_close(&sway_ipc_state);
+	wsbg_watcher_destroy(watcher);
 
 	struct wsbg_output *output, *tmp_output;
 	wl_list_for_each_safe(output, tmp_output, &state.outputs, link) {
 		destroy_wsbg_output(output);
 	}
+	wsbg_animator_destroy(state.animator);
+	wsbg_renderer_destroy(state.renderer);
+	struct wsbg_slideshow *slideshow, *tmp_slideshow;
+	wl_list_for_each_safe(slideshow, tmp_slideshow, &state.slideshows, link) {
+		wsbg_slideshow_destroy(slideshow);
+	}
+	if (state.slideshow_timer != -1) {
+		close(state.slideshow_timer);
+	}
+	wsbg_shm_destroy(state.pools);
+	wsbg_disk_cache_destroy(state.disk_cache);
 
 	struct wsbg_option *option, *tmp_option;
 	wl_list_for_each_safe(option, tmp_option, &state.options, link) {
@@ -1001,8 +1852,11 @@ exit:
 	wl_list_for_each_safe(workspace, tmp_workspace, &state.workspaces, link) {
 		destroy_wsbg_workspace(workspace);
 	}
+	wl_list_for_each_safe(workspace, tmp_workspace, &state.existing, link) {
+		destroy_wsbg_workspace(workspace);
+	}
 
-	struct wsbg_image *image, *tmp_image;
+	struct wsbg_image *tmp_image;
 	wl_list_for_each_safe(image, tmp_image, &state.images, link) {
 		destroy_wsbg_image(image);
 	}
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "buffer.h"
+#include "image.h"
+#include "log.h"
+#include "preload.h"
+#include "workers.h"
+
+struct wsbg_preloader {
+	struct wsbg_state *state;
+	struct wsbg_workers *workers;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done;  // signalled whenever an image is decoded
+	struct wsbg_preload_item *items;
+	unsigned count;
+	size_t memory;  // held by the decoded images, protected by `lock`
+};
+
+static void preload_image(void *data, unsigned index) {
+	struct wsbg_preloader *preloader = data;
+	struct wsbg_state *state = preloader->state;
+	struct wsbg_preload_item *item = &preloader->items[index];
+	struct wsbg_image *image = item->image;
+
+	// Images beyond the budget would only be evicted again
+	pthread_mutex_lock(&preloader->lock);
+	bool pending = image->preload == WSBG_PRELOAD_PENDING;
+	if (pending && state->max_image_memory &&
+			preloader->memory >= state->max_image_memory) {
+		image->preload = WSBG_PRELOAD_NONE;
+		pending = false;
+	} else if (pending) {
+		image->preload = WSBG_PRELOAD_RUNNING;
+	}
+	pthread_mutex_unlock(&preloader->lock);
+	if (!pending) {
+		return;
+	}
+
+	// Images are only probed without a size, and decoded once it is known:
+	// reducible ones at the size they're drawn at, and not at all when
+	// they're decoded straight into their buffer
+	bool loaded = load_wsbg_image(state, image, item->background, 0, 0);
+	if (loaded && !image->surface && !image->is_scalable &&
+			!is_wsbg_image_decoded_directly(state, image, item->mode,
+				item->position, item->width, item->height)) {
+		int scaled_width = 0, scaled_height = 0;
+		if (image->is_reducible) {
+			get_wsbg_reduced_size(state, image, item->mode, item->position,
+					item->width, item->height,
+					&scaled_width, &scaled_height);
+		}
+		loaded = load_wsbg_image(state, image, item->background,
+				scaled_width, scaled_height);
+	}
+	if (loaded && image->surface) {
+		wsbg_log(LOG_DEBUG, "Preloaded image %s", image->path);
+	}
+
+	pthread_mutex_lock(&preloader->lock);
+	preloader->memory += get_image_memory(image);
+	image->preload = WSBG_PRELOAD_NONE;
+	pthread_cond_broadcast(&preloader->done);
+	pthread_mutex_unlock(&preloader->lock);
+}
+
+static void *preload_main(void *data) {
+	struct wsbg_preloader *preloader = data;
+	wsbg_workers_run(preloader->workers,
+			preload_image, preloader, preloader->count);
+	return NULL;
+}
+
+struct wsbg_preloader *wsbg_preloader_create(struct wsbg_state *state,
+		struct wsbg_preload_item *items, unsigned count) {
+	struct wsbg_preloader *preloader = NULL;
+	if (count == 0 || !(preloader = calloc(1, sizeof *preloader))) {
+		if (count != 0) {
+			wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		}
+		goto error;
+	}
+	preloader->state = state;
+	preloader->items = items;
+	preloader->count = count;
+	pthread_mutex_init(&preloader->lock, NULL);
+	pthread_cond_init(&preloader->done, NULL);
+	for (unsigned i = 0; i < count; ++i) {
+		items[i].image->preload = WSBG_PRELOAD_PENDING;
+	}
+
+	// The thread running the loop decodes too, so it makes up the count
+	preloader->workers = wsbg_workers_create(state->threads);
+	int err = pthread_create(&preloader->thread, NULL,
+			preload_main, preloader);
+	if (err) {
+		errno = err;
+		wsbg_log_errno(LOG_ERROR, "Unable to start preload thread");
+		for (unsigned i = 0; i < count; ++i) {
+			items[i].image->preload = WSBG_PRELOAD_NONE;
+		}
+		wsbg_workers_destroy(preloader->workers);
+		pthread_cond_destroy(&preloader->done);
+		pthread_mutex_destroy(&preloader->lock);
+		free(preloader);
+		preloader = NULL;
+		goto error;
+	}
+	return preloader;
+
+error:
+	free(items);
+	return preloader;
+}
+
+void wsbg_preloader_destroy(struct wsbg_preloader *preloader) {
+	if (!preloader) {
+		return;
+	}
+	pthread_mutex_lock(&preloader->lock);
+	for (unsigned i = 0; i < preloader->count; ++i) {
+		if (preloader->items[i].image->preload == WSBG_PRELOAD_PENDING) {
+			preloader->items[i].image->preload = WSBG_PRELOAD_NONE;
+		}
+	}
+	pthread_mutex_unlock(&preloader->lock);
+
+	pthread_join(preloader->thread, NULL);
+	wsbg_workers_destroy(preloader->workers);
+	pthread_cond_destroy(&preloader->done);
+	pthread_mutex_destroy(&preloader->lock);
+	free(preloader->items);
+	free(preloader);
+}
+
+void wsbg_preloader_claim(struct wsbg_preloader *preloader,
+		struct wsbg_image *image) {
+	if (!preloader) {
+		return;
+	}
+	pthread_mutex_lock(&preloader->lock);
+	if (image->preload == WSBG_PRELOAD_PENDING) {
+		image->preload = WSBG_PRELOAD_NONE;
+	}
+	while (image->preload == WSBG_PRELOAD_RUNNING) {
+		pthread_cond_wait(&preloader->done, &preloader->lock);
+	}
+	pthread_mutex_unlock(&preloader->lock);
+}
+
+bool wsbg_preloader_is_busy(struct wsbg_preloader *preloader,
+		struct wsbg_image *image) {
+	if (!preloader) {
+		return false;
+	}
+	pthread_mutex_lock(&preloader->lock);
+	bool busy = image->preload != WSBG_PRELOAD_NONE;
+	pthread_mutex_unlock(&preloader->lock);
+	return busy;
+}
@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "buffer.h"
+#include "image.h"
+#include "log.h"
+#include "preload.h"
+#include "render.h"
+#include "workers.h"
+
+// Nice value of the render thread and its workers
+#define RENDER_NICE 10
+
+// An image to load again, from another file if `path` is set
+struct wsbg_renderer {
+	struct wsbg_state *state;
+	pthread_t thread;
+	int fd;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list queue;  // struct wsbg_render_job::link, by priority
+	struct wl_list done;   // struct wsbg_render_job::link
+	struct wl_array reloads;  // struct wsbg_image *
+	struct wsbg_render_job *current;
+	bool exit;
+};
+
+static bool job_precedes(struct wsbg_render_job *a,
+		struct wsbg_render_job *b) {
+	return a->priority < b->priority ||
+		(a->priority == b->priority && a->refine <= b->refine);
+}
+
+static void insert_job(struct wsbg_renderer *renderer,
+		struct wsbg_render_job *job) {
+	struct wsbg_render_job *needle;
+	wl_list_for_each_reverse(needle, &renderer->queue, link) {
+		if (job_precedes(needle, job)) {
+			break;
+		}
+	}
+	wl_list_insert(&needle->link, &job->link);
+}
+
+/**
+ * Queues a job rendering the config of `job` again with its own filter.
+ * Must be called with the lock held.
+ */
+static void queue_refine_job(struct wsbg_renderer *renderer,
+		struct wsbg_render_job *job) {
+	struct wsbg_render_job *refine = calloc(1, sizeof *refine);
+	if (!refine) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return;
+	}
+	refine->output = job->output;
+	refine->config = job->config;
+	refine->params = job->params;
+	refine->width = job->width;
+	refine->height = job->height;
+	refine->surface_width = job->surface_width;
+	refine->surface_height = job->surface_height;
+	refine->rotation = job->rotation;
+	refine->priority = job->priority;
+	refine->refine = true;
+	atomic_init(&refine->cancelled, false);
+	insert_job(renderer, refine);
+}
+
+static void cancel_job(struct wsbg_render_job *job) {
+	job->output = NULL;
+	job->config = NULL;
+	atomic_store(&job->cancelled, true);
+}
+
+/**
+ * Releases the least recently used decoded images until the rest fit in
+ * the image memory budget.
+ */
+static void evict_images(struct wsbg_state *state, size_t max_memory) {
+	// Images the preloader may still be decoding are left alone, down to
+	// their fields, and don't count until they are done. Once done, they
+	// are never busy again.
+	size_t memory = 0;
+	struct wsbg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (!wsbg_preloader_is_busy(state->preloader, image)) {
+			memory += get_image_memory(image);
+		}
+	}
+
+	while (memory > max_memory) {
+		struct wsbg_image *lru = NULL;
+		wl_list_for_each(image, &state->images, link) {
+			if (!wsbg_preloader_is_busy(state->preloader, image) &&
+					image->surface &&
+					(!lru || image->last_used < lru->last_used)) {
+				lru = image;
+			}
+		}
+		if (!lru) {
+			break;
+		}
+
+		memory -= get_image_memory(lru);
+		unload_image(lru);
+		++state->image_evictions;
+		wsbg_log(LOG_DEBUG, "Evicted image %s (%u loads, %u hits, "
+				"%u evictions)", lru->path, state->image_loads,
+				state->image_hits, state->image_evictions);
+	}
+}
+
+/**
+ * Starts decoding every image at once, those of queued jobs first, in the
+ * order of the queue. Must be called with the lock held.
+ */
+static void start_preload(struct wsbg_renderer *renderer) {
+	struct wsbg_state *state = renderer->state;
+	// Slideshow images are only known from the jobs showing them
+	unsigned count = wl_list_length(&state->images) +
+		wl_list_length(&renderer->queue);
+	struct wsbg_preload_item *items = calloc(count, sizeof *items);
+	if (count && !items) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return;
+	}
+
+	unsigned n = 0;
+	struct wsbg_render_job *job;
+	wl_list_for_each(job, &renderer->queue, link) {
+		struct wsbg_image *image = job->params.image;
+		unsigned i = 0;
+		while (i < n && items[i].image != image) {
+			++i;
+		}
+		if (image && i == n) {
+			items[n++] = (struct wsbg_preload_item){
+				.image = image,
+				.background = job->params.color,
+				.mode = job->params.mode,
+				.position = job->params.position,
+				.width = job->width,
+				.height = job->height,
+			};
+		}
+	}
+	// Images no job shows yet are blended with the default color
+	struct wsbg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		unsigned i = 0;
+		while (i < n && items[i].image != image) {
+			++i;
+		}
+		if (i == n && !image->is_directory) {
+			items[n++] = (struct wsbg_preload_item){
+				.image = image,
+				.background = { .a = 0xFF },
+			};
+		}
+	}
+	state->preloader = wsbg_preloader_create(state, items, n);
+}
+
+/**
+ * Drops everything decoded or rendered from `image`, and what is known
+ * about it, so that it's loaded again from its changed file.
+ */
+static void reload_image(struct wsbg_state *state, struct wsbg_image *image) {
+	wsbg_preloader_claim(state->preloader, image);
+	unload_image(image);
+	image->width = image->height = 0;
+	image->is_scalable = false;
+	image->is_reducible = false;
+	forget_wsbg_image_buffers(image);
+	wsbg_log(LOG_DEBUG, "Reloading image %s", image->path);
+}
+
+static void *render_main(void *data) {
+	struct wsbg_renderer *renderer = data;
+	struct wsbg_state *state = renderer->state;
+
+#ifdef __linux__
+	// Linux priorities are per thread, and inherited by the workers
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), RENDER_NICE) == -1) {
+		wsbg_log_errno(LOG_DEBUG, "Unable to lower render thread priority");
+	}
+#endif
+	state->workers = wsbg_workers_create(state->threads);
+
+	bool images_loaded = false, preloaded = false;
+	pthread_mutex_lock(&renderer->lock);
+	while (true) {
+		// Changed images are reloaded before any job renders them
+		if (!renderer->exit && renderer->reloads.size) {
+			struct wl_array reloads = renderer->reloads;
+			wl_array_init(&renderer->reloads);
+			pthread_mutex_unlock(&renderer->lock);
+			struct wsbg_image **image;
+			wl_array_for_each(image, &reloads) {
+				reload_image(state, *image);
+			}
+			wl_array_release(&reloads);
+			pthread_mutex_lock(&renderer->lock);
+			continue;
+		}
+		if (!renderer->exit && wl_list_empty(&renderer->queue)) {
+			if (images_loaded) {
+				// Nothing left to render, so decoded images are only kept
+				// within their budget, and images no job needed don't need
+				// decoding anymore
+				pthread_mutex_unlock(&renderer->lock);
+				wsbg_preloader_destroy(state->preloader);
+				state->preloader = NULL;
+				evict_images(state, state->max_image_memory);
+				images_loaded = false;
+				pthread_mutex_lock(&renderer->lock);
+			} else {
+				pthread_cond_wait(&renderer->cond, &renderer->lock);
+			}
+			continue;
+		} else if (renderer->exit) {
+			break;
+		}
+
+		// The first jobs show which images are needed first
+		if (!preloaded) {
+			preloaded = true;
+			start_preload(renderer);
+		}
+
+		struct wsbg_render_job *job =
+			wl_container_of(renderer->queue.next, job, link);
+		wl_list_remove(&job->link);
+		renderer->current = job;
+		pthread_mutex_unlock(&renderer->lock);
+
+		bool refine = false;
+		if (!atomic_load(&job->cancelled)) {
+			job->buffer = get_wsbg_buffer(&job->params, state,
+					job->width, job->height,
+					job->surface_width, job->surface_height,
+					&job->source, &job->box,
+					state->progressive && job->priority == 0 && !job->refine,
+					&refine, &job->cancelled);
+			images_loaded = true;
+			if (job->buffer && job->rotation) {
+				job->buffer = get_wsbg_rotated_buffer(
+						state, job->buffer, job->rotation);
+			}
+
+			// Without a budget, images are kept until the queue is empty
+			if (state->max_image_memory) {
+				evict_images(state, state->max_image_memory);
+			}
+		}
+		if (job->buffer && job->box.width && !(job->background =
+				get_wsbg_color_buffer(state, job->params.color))) {
+			release_wsbg_buffer(job->buffer);
+			job->buffer = NULL;
+		}
+
+		pthread_mutex_lock(&renderer->lock);
+		renderer->current = NULL;
+		if (refine && job->buffer && !atomic_load(&job->cancelled)) {
+			queue_refine_job(renderer, job);
+		}
+		wl_list_insert(renderer->done.prev, &job->link);
+		if (eventfd_write(renderer->fd, 1) == -1) {
+			wsbg_log_errno(LOG_ERROR, "Unable to signal finished render");
+		}
+	}
+	pthread_mutex_unlock(&renderer->lock);
+
+	wsbg_preloader_destroy(state->preloader);
+	state->preloader = NULL;
+	struct wsbg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		unload_image(image);
+	}
+	unload_wsbg_filters();
+	wsbg_workers_destroy(state->workers);
+	state->workers = NULL;
+	return NULL;
+}
+
+struct wsbg_renderer *wsbg_renderer_create(struct wsbg_state *state) {
+	struct wsbg_renderer *renderer = calloc(1, sizeof *renderer);
+	if (!renderer) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	renderer->state = state;
+	wl_list_init(&renderer->queue);
+	wl_list_init(&renderer->done);
+	wl_array_init(&renderer->reloads);
+	pthread_mutex_init(&renderer->lock, NULL);
+	pthread_cond_init(&renderer->cond, NULL);
+
+	renderer->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (renderer->fd == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to create eventfd");
+		goto error;
+	}
+
+	int err = pthread_create(&renderer->thread, NULL, render_main, renderer);
+	if (err) {
+		errno = err;
+		wsbg_log_errno(LOG_ERROR, "Unable to start render thread");
+		close(renderer->fd);
+		goto error;
+	}
+	return renderer;
+
+error:
+	pthread_cond_destroy(&renderer->cond);
+	pthread_mutex_destroy(&renderer->lock);
+	free(renderer);
+	return NULL;
+}
+
+void wsbg_renderer_destroy(struct wsbg_renderer *renderer) {
+	if (!renderer) {
+		return;
+	}
+	pthread_mutex_lock(&renderer->lock);
+	renderer->exit = true;
+	if (renderer->current) {
+		cancel_job(renderer->current);
+	}
+	pthread_cond_signal(&renderer->cond);
+	pthread_mutex_unlock(&renderer->lock);
+	pthread_join(renderer->thread, NULL);
+
+	struct wsbg_render_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &renderer->queue, link) {
+		wl_list_remove(&job->link);
+		free(job);
+	}
+	wl_list_for_each_safe(job, tmp, &renderer->done, link) {
+		wl_list_remove(&job->link);
+		release_wsbg_buffer(job->buffer);
+		release_wsbg_buffer(job->background);
+		free(job);
+	}
+	wl_array_release(&renderer->reloads);
+	close(renderer->fd);
+	pthread_cond_destroy(&renderer->cond);
+	pthread_mutex_destroy(&renderer->lock);
+	free(renderer);
+}
+
+int wsbg_renderer_get_fd(struct wsbg_renderer *renderer) {
+	return renderer->fd;
+}
+
+void wsbg_renderer_submit(struct wsbg_renderer *renderer,
+		struct wsbg_output *output, struct wsbg_config *config,
+		int32_t width, int32_t height,
+		int32_t surface_width, int32_t surface_height, uint32_t rotation,
+		int priority) {
+	pthread_mutex_lock(&renderer->lock);
+
+	struct wsbg_render_job *current = renderer->current;
+	if (current && current->config == config) {
+		if (current->width == width && current->height == height &&
+				current->surface_width == surface_width &&
+				current->surface_height == surface_height) {
+			goto unlock;
+		}
+		cancel_job(current);
+	} else if (current && current->output == output &&
+			current->priority == 0 && priority == 0) {
+		// The output switched to another workspace
+		cancel_job(current);
+	}
+
+	struct wsbg_render_job *job;
+	wl_list_for_each(job, &renderer->done, link) {
+		if (job->config == config &&
+				job->width == width && job->height == height &&
+				job->surface_width == surface_width &&
+				job->surface_height == surface_height) {
+			goto unlock;
+		}
+	}
+	wl_list_for_each(job, &renderer->queue, link) {
+		if (job->config == config) {
+			wl_list_remove(&job->link);
+			goto update;
+		}
+	}
+
+	if (!(job = calloc(1, sizeof *job))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		goto unlock;
+	}
+	job->output = output;
+	job->config = config;
+	atomic_init(&job->cancelled, false);
+
+update:
+	// Queued jobs render the config as it is now, and a new size needs a
+	// new first pass
+	job->params = *config;
+	job->refine = false;
+	job->width = width;
+	job->height = height;
+	job->surface_width = surface_width;
+	job->surface_height = surface_height;
+	job->rotation = rotation;
+	job->priority = priority;
+	insert_job(renderer, job);
+	pthread_cond_signal(&renderer->cond);
+
+unlock:
+	pthread_mutex_unlock(&renderer->lock);
+}
+
+void wsbg_renderer_cancel(struct wsbg_renderer *renderer,
+		struct wsbg_config *config) {
+	if (!renderer) {
+		return;
+	}
+	pthread_mutex_lock(&renderer->lock);
+	if (renderer->current && renderer->current->config == config) {
+		cancel_job(renderer->current);
+	}
+	struct wsbg_render_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &renderer->queue, link) {
+		if (job->config == config) {
+			wl_list_remove(&job->link);
+			free(job);
+		}
+	}
+	wl_list_for_each(job, &renderer->done, link) {
+		if (job->config == config) {
+			cancel_job(job);
+		}
+	}
+	pthread_mutex_unlock(&renderer->lock);
+}
+
+void wsbg_renderer_demote(struct wsbg_renderer *renderer,
+		struct wsbg_config *config, int priority) {
+	if (!renderer) {
+		return;
+	}
+	pthread_mutex_lock(&renderer->lock);
+	struct wsbg_render_job *job;
+	wl_list_for_each(job, &renderer->queue, link) {
+		if (job->config == config) {
+			if (job->priority < priority) {
+				wl_list_remove(&job->link);
+				job->priority = priority;
+				insert_job(renderer, job);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&renderer->lock);
+}
+
+void wsbg_renderer_dispatch(struct wsbg_renderer *renderer,
+		wsbg_render_done_func_t func, void *data) {
+	eventfd_t count;
+	if (eventfd_read(renderer->fd, &count) == -1 && errno != EAGAIN) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read render eventfd");
+	}
+
+	struct wl_list done;
+	pthread_mutex_lock(&renderer->lock);
+	wl_list_init(&done);
+	wl_list_insert_list(&done, &renderer->done);
+	wl_list_init(&renderer->done);
+	pthread_mutex_unlock(&renderer->lock);
+
+	struct wsbg_render_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &done, link) {
+		if (job->config) {
+			func(job, data);
+		}
+		wl_list_remove(&job->link);
+		release_wsbg_buffer(job->buffer);
+		release_wsbg_buffer(job->background);
+		free(job);
+	}
+}
+
+void wsbg_renderer_reload_image(struct wsbg_renderer *renderer,
+		struct wsbg_image *image) {
+	pthread_mutex_lock(&renderer->lock);
+	// Buffers of the old file are stale, while queued jobs render the new one
+	if (renderer->current && renderer->current->params.image == image) {
+		cancel_job(renderer->current);
+	}
+	struct wsbg_render_job *job;
+	wl_list_for_each(job, &renderer->done, link) {
+		if (job->params.image == image) {
+			cancel_job(job);
+		}
+	}
+
+	struct wsbg_image **reload;
+	wl_array_for_each(reload, &renderer->reloads) {
+		if (*reload == image) {
+			goto unlock;
+		}
+	}
+	if (!(reload = wl_array_add(&renderer->reloads, sizeof *reload))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		goto unlock;
+	}
+	*reload = image;
+	pthread_cond_signal(&renderer->cond);
+
+unlock:
+	pthread_mutex_unlock(&renderer->lock);
+}
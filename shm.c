@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "log.h"
+#include "shm.h"
+
+// Smallest buffer put on huge pages when they are enabled
+#define HUGE_PAGE_BUFFER_MIN ((size_t)16 << 20)
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Size of a new pool, unless the buffer it is created for needs more
+#define POOL_SIZE_MIN ((size_t)1 << 20)
+// Pools aren't grown past this size
+#define POOL_SIZE_MAX ((size_t)256 << 20)
+// Alignment of blocks in a pool
+#define BLOCK_ALIGN ((size_t)64)
+
+struct wsbg_shm {
+	struct wl_shm *shm;
+	bool huge_pages;
+
+	pthread_mutex_t lock;
+	struct wl_list pools;  // struct wsbg_shm_pool::link
+};
+
+struct wsbg_shm_pool {
+	struct wsbg_shm *shm;
+	struct wl_shm_pool *pool;
+	int fd;
+	void *data;
+	size_t size;
+	bool huge;
+	struct wl_list blocks;  // struct wsbg_shm_block::link, by offset
+	struct wl_list link;
+};
+
+/**
+ * A used or free range of a pool. The blocks of a pool cover all of it.
+ */
+struct wsbg_shm_block {
+	struct wsbg_shm_pool *pool;
+	size_t offset, size;
+	bool used;
+	struct wl_list link;
+};
+
+static size_t align_size(size_t size, size_t alignment) {
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static bool truncate_file(int fd, size_t size) {
+	while (ftruncate(fd, size) == -1) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int create_memfd(size_t size, unsigned flags) {
+#ifdef MFD_ALLOW_SEALING
+	int fd = memfd_create("wsbg", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+	if (fd == -1) {
+		return -1;
+	} else if (!truncate_file(fd, size)) {
+		close(fd);
+		return -1;
+	}
+	// Pools only ever grow, so the compositor can map them without
+	// guarding against the file shrinking under it
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int create_tmpfile(size_t size) {
+	static const char *template = "wsbg-XXXXXX";
+	const char *path = getenv("XDG_RUNTIME_DIR");
+	if (path == NULL) {
+		wsbg_log(LOG_ERROR, "XDG_RUNTIME_DIR is not set");
+		return -1;
+	}
+
+	size_t name_size = strlen(template) + 1 + strlen(path) + 1;
+	char *name = malloc(name_size);
+	if (name == NULL) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return -1;
+	}
+	snprintf(name, name_size, "%s/%s", path, template);
+
+	int fd = mkstemp(name);
+	if (fd == -1) {
+		wsbg_log_errno(LOG_ERROR, "Temp file creation failed");
+	} else {
+		unlink(name);
+		if (!truncate_file(fd, size)) {
+			wsbg_log_errno(LOG_ERROR, "Temp file creation failed");
+			close(fd);
+			fd = -1;
+		}
+	}
+	free(name);
+	return fd;
+}
+
+static void *map_file(int fd, size_t size, bool huge) {
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#ifdef MADV_HUGEPAGE
+	if (data != MAP_FAILED && huge) {
+		// Transparent huge pages, where enabled for shared memory
+		madvise(data, size, MADV_HUGEPAGE);
+	}
+#endif
+	return data;
+}
+
+static struct wsbg_shm_block *add_block(struct wsbg_shm_pool *pool,
+		struct wl_list *prev, size_t offset, size_t size) {
+	struct wsbg_shm_block *block = calloc(1, sizeof *block);
+	if (!block) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	block->pool = pool;
+	block->offset = offset;
+	block->size = size;
+	wl_list_insert(prev, &block->link);
+	return block;
+}
+
+static void destroy_pool(struct wsbg_shm_pool *pool) {
+	struct wsbg_shm_block *block, *tmp;
+	wl_list_for_each_safe(block, tmp, &pool->blocks, link) {
+		wl_list_remove(&block->link);
+		free(block);
+	}
+	wl_list_remove(&pool->link);
+	wl_shm_pool_destroy(pool->pool);
+	munmap(pool->data, pool->size);
+	close(pool->fd);
+	free(pool);
+}
+
+static struct wsbg_shm_pool *create_pool(struct wsbg_shm *shm,
+		size_t size, bool huge) {
+	struct wsbg_shm_pool *pool = calloc(1, sizeof *pool);
+	if (!pool) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	pool->shm = shm;
+	pool->huge = huge;
+	pool->data = MAP_FAILED;
+	pool->fd = -1;
+	wl_list_init(&pool->blocks);
+
+#ifdef MFD_HUGETLB
+	if (huge) {
+		if ((pool->fd = create_memfd(size, MFD_HUGETLB)) != -1 &&
+				(pool->data = map_file(pool->fd, size, false)) == MAP_FAILED) {
+			close(pool->fd);
+			pool->fd = -1;
+		}
+		if (pool->fd == -1) {
+			wsbg_log_errno(LOG_DEBUG, "Unable to allocate huge pages");
+		}
+	}
+#endif
+
+	if (pool->fd == -1) {
+		if ((pool->fd = create_memfd(size, 0)) == -1 &&
+				(pool->fd = create_tmpfile(size)) == -1) {
+			free(pool);
+			return NULL;
+		}
+		if ((pool->data = map_file(pool->fd, size, huge)) == MAP_FAILED) {
+			wsbg_log_errno(LOG_ERROR, "Shared memory map failed");
+			close(pool->fd);
+			free(pool);
+			return NULL;
+		}
+	}
+	pool->size = size;
+
+	if (!add_block(pool, &pool->blocks, 0, size)) {
+		munmap(pool->data, pool->size);
+		close(pool->fd);
+		free(pool);
+		return NULL;
+	}
+	pool->pool = wl_shm_create_pool(shm->shm, pool->fd, size);
+	wl_list_insert(shm->pools.prev, &pool->link);
+	return pool;
+}
+
+/**
+ * Grows `pool` to `size` bytes and returns its last block, which is free.
+ */
+static struct wsbg_shm_block *grow_pool(struct wsbg_shm_pool *pool,
+		size_t size) {
+	void *data = MAP_FAILED;
+	if (truncate_file(pool->fd, size)) {
+		data = map_file(pool->fd, size, pool->huge);
+	}
+	if (data == MAP_FAILED) {
+		wsbg_log_errno(LOG_DEBUG, "Unable to grow shared memory pool");
+		return NULL;
+	}
+
+	struct wsbg_shm_block *last =
+		wl_container_of(pool->blocks.prev, last, link);
+	if (last->used) {
+		if (!(last = add_block(pool, pool->blocks.prev,
+				pool->size, size - pool->size))) {
+			munmap(data, size);
+			return NULL;
+		}
+	} else {
+		last->size += size - pool->size;
+	}
+
+	munmap(pool->data, pool->size);
+	pool->data = data;
+	pool->size = size;
+	wl_shm_pool_resize(pool->pool, size);
+	return last;
+}
+
+static bool pool_is_empty(struct wsbg_shm_pool *pool) {
+	struct wsbg_shm_block *first =
+		wl_container_of(pool->blocks.next, first, link);
+	return !first->used && first->size == pool->size;
+}
+
+/**
+ * Returns the smallest free block of at least `size` bytes, growing
+ * or adding a pool when there is none. Must be called with `lock` held.
+ */
+static struct wsbg_shm_block *find_block(struct wsbg_shm *shm,
+		size_t size, bool huge) {
+	struct wsbg_shm_block *best = NULL;
+	struct wsbg_shm_pool *pool;
+	wl_list_for_each(pool, &shm->pools, link) {
+		if (pool->huge != huge) {
+			continue;
+		}
+		struct wsbg_shm_block *block;
+		wl_list_for_each(block, &pool->blocks, link) {
+			if (!block->used && block->size >= size &&
+					(!best || block->size < best->size)) {
+				best = block;
+			}
+		}
+	}
+	if (best) {
+		return best;
+	}
+
+	wl_list_for_each(pool, &shm->pools, link) {
+		if (pool->huge != huge) {
+			continue;
+		}
+		struct wsbg_shm_block *last =
+			wl_container_of(pool->blocks.prev, last, link);
+		size_t needed = pool->size + size - (last->used ? 0 : last->size);
+		if (needed > POOL_SIZE_MAX) {
+			continue;
+		}
+		size_t grown = pool->size * 2 > needed ? pool->size * 2 : needed;
+		if (grown > POOL_SIZE_MAX) {
+			grown = POOL_SIZE_MAX;
+		}
+		if (huge) {
+			grown = align_size(grown, HUGE_PAGE_SIZE);
+		}
+		if ((best = grow_pool(pool, grown))) {
+			return best;
+		}
+	}
+
+	size_t pool_size = size > POOL_SIZE_MIN ? size : POOL_SIZE_MIN;
+	if (huge) {
+		pool_size = align_size(pool_size, HUGE_PAGE_SIZE);
+	}
+	if (!(pool = create_pool(shm, pool_size, huge))) {
+		return NULL;
+	}
+	return wl_container_of(pool->blocks.next, best, link);
+}
+
+struct wsbg_shm *wsbg_shm_create(struct wl_shm *wl_shm, bool huge_pages) {
+	struct wsbg_shm *shm = calloc(1, sizeof *shm);
+	if (!shm) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	shm->shm = wl_shm;
+	shm->huge_pages = huge_pages;
+	pthread_mutex_init(&shm->lock, NULL);
+	wl_list_init(&shm->pools);
+	return shm;
+}
+
+void wsbg_shm_destroy(struct wsbg_shm *shm) {
+	if (!shm) {
+		return;
+	}
+	struct wsbg_shm_pool *pool, *tmp;
+	wl_list_for_each_safe(pool, tmp, &shm->pools, link) {
+		destroy_pool(pool);
+	}
+	pthread_mutex_destroy(&shm->lock);
+	free(shm);
+}
+
+struct wsbg_shm_block *wsbg_shm_alloc(struct wsbg_shm *shm,
+		int32_t width, int32_t height, int32_t stride, uint32_t format,
+		struct wl_buffer **buffer) {
+	if (width <= 0 || height <= 0 || stride <= 0 ||
+			(size_t)height * stride > INT32_MAX - BLOCK_ALIGN) {
+		wsbg_log(LOG_ERROR, "Invalid buffer size %dx%d", width, height);
+		return NULL;
+	}
+	size_t size = align_size((size_t)height * stride, BLOCK_ALIGN);
+	bool huge = shm->huge_pages && size >= HUGE_PAGE_BUFFER_MIN;
+
+	pthread_mutex_lock(&shm->lock);
+	struct wsbg_shm_block *block = find_block(shm, size, huge);
+	if (block) {
+		// Keep the rest of the block free, or all of it used if
+		// the allocation for the rest fails
+		if (block->size > size && add_block(block->pool, &block->link,
+				block->offset + size, block->size - size)) {
+			block->size = size;
+		}
+		block->used = true;
+		*buffer = wl_shm_pool_create_buffer(block->pool->pool,
+				block->offset, width, height, stride, format);
+	}
+	pthread_mutex_unlock(&shm->lock);
+	return block;
+}
+
+void *wsbg_shm_block_data(struct wsbg_shm_block *block) {
+	return (char *)block->pool->data + block->offset;
+}
+
+void wsbg_shm_free(struct wsbg_shm_block *block) {
+	if (!block) {
+		return;
+	}
+	struct wsbg_shm_pool *pool = block->pool;
+	struct wsbg_shm *shm = pool->shm;
+
+	pthread_mutex_lock(&shm->lock);
+	block->used = false;
+
+	struct wsbg_shm_block *next = wl_container_of(block->link.next, next, link);
+	if (&next->link != &pool->blocks && !next->used) {
+		block->size += next->size;
+		wl_list_remove(&next->link);
+		free(next);
+	}
+	struct wsbg_shm_block *prev = wl_container_of(block->link.prev, prev, link);
+	if (&prev->link != &pool->blocks && !prev->used) {
+		prev->size += block->size;
+		wl_list_remove(&block->link);
+		free(block);
+	}
+
+	if (pool_is_empty(pool)) {
+		// Keep one empty pool around for the next buffers
+		struct wsbg_shm_pool *other;
+		wl_list_for_each(other, &shm->pools, link) {
+			if (other != pool && pool_is_empty(other)) {
+				destroy_pool(other->size < pool->size ? other : pool);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&shm->lock);
+}
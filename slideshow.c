@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "image.h"
+#include "log.h"
+#include "slideshow.h"
+
+// Files are told apart by name, as decoding them to find out is too slow
+static const char *image_extensions[] = {
+	"avif", "bmp", "gif", "heic", "heif", "jpeg", "jpg", "jxl", "png",
+	"raw", "svg", "tif", "tiff", "webp",
+};
+
+static int filter_image(const struct dirent *entry) {
+	const char *extension = strrchr(entry->d_name, '.');
+	if (entry->d_name[0] == '.' || !extension) {
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof image_extensions /
+			sizeof *image_extensions; ++i) {
+		if (strcasecmp(extension + 1, image_extensions[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static struct wsbg_image *create_image(const char *path) {
+	struct wsbg_image *image = calloc(1, sizeof *image);
+	if (!image) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	image->path = path;
+	wl_list_init(&image->link);
+	return image;
+}
+
+struct wsbg_slideshow *wsbg_slideshow_create(const char *path,
+		unsigned interval) {
+	struct wsbg_slideshow *slideshow = calloc(1, sizeof *slideshow);
+	if (!slideshow || !(slideshow->path = strdup(path))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		free(slideshow);
+		return NULL;
+	}
+	slideshow->interval = interval;
+	wl_list_init(&slideshow->link);
+
+	struct dirent **entries;
+	int count = scandir(path, &entries, filter_image, alphasort);
+	if (count == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read directory %s", path);
+		goto error;
+	}
+	if (count > 0 &&
+			!(slideshow->files = calloc(count, sizeof *slideshow->files))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+	}
+	for (int i = 0; i < count; ++i) {
+		if (slideshow->files && (slideshow->files[slideshow->count] =
+				malloc(strlen(path) + strlen(entries[i]->d_name) + 2))) {
+			sprintf(slideshow->files[slideshow->count++], "%s/%s",
+					path, entries[i]->d_name);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	if (slideshow->count == 0) {
+		wsbg_log(LOG_ERROR, "No images in directory %s", path);
+		goto error;
+	}
+
+	if (!(slideshow->current = create_image(slideshow->files[0]))) {
+		goto error;
+	}
+	if (slideshow->count > 1 &&
+			!(slideshow->next = create_image(slideshow->files[1]))) {
+		goto error;
+	}
+	return slideshow;
+
+error:
+	wsbg_slideshow_destroy(slideshow);
+	return NULL;
+}
+
+void wsbg_slideshow_destroy(struct wsbg_slideshow *slideshow) {
+	if (!slideshow) {
+		return;
+	}
+	wl_list_remove(&slideshow->link);
+	if (slideshow->current) {
+		unload_image(slideshow->current);
+		free(slideshow->current);
+	}
+	if (slideshow->next) {
+		unload_image(slideshow->next);
+		free(slideshow->next);
+	}
+	for (size_t i = 0; i < slideshow->count; ++i) {
+		free(slideshow->files[i]);
+	}
+	free(slideshow->files);
+	free(slideshow->path);
+	free(slideshow);
+}
+
+const char *wsbg_slideshow_advance(struct wsbg_slideshow *slideshow) {
+	if (!slideshow->next) {
+		return NULL;
+	}
+	struct wsbg_image *image = slideshow->current;
+	slideshow->current = slideshow->next;
+	slideshow->next = image;
+
+	// With two files, the old current image is also the next one
+	size_t count = slideshow->count;
+	size_t previous = slideshow->index;
+	slideshow->index = (slideshow->index + 1) % count;
+	size_t next = (slideshow->index + 1) % count;
+	return next == previous ? NULL : slideshow->files[next];
+}
@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "log.h"
+#include "watch.h"
+
+// A file is written in place, or another one is moved over it
+#define FILE_EVENTS IN_CLOSE_WRITE
+#define DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch {
+	struct wsbg_image *image;
+	char *dir;
+	const char *name;  // of the file in `dir`
+	int file_wd, dir_wd;  // -1 when not watched
+	bool changed;
+};
+
+struct wsbg_watcher {
+	int fd;
+	struct watch *watches;
+	size_t count;
+};
+
+/**
+ * Watches the file of `watch`, which may be another file than before once
+ * it was replaced. Symbolic links are followed, so that changes of the
+ * file they point to are noticed too.
+ */
+static void watch_file(struct wsbg_watcher *watcher, struct watch *watch) {
+	watch->file_wd = inotify_add_watch(watcher->fd,
+			watch->image->path, FILE_EVENTS);
+	if (watch->file_wd == -1) {
+		wsbg_log_errno(LOG_DEBUG, "Unable to watch %s", watch->image->path);
+	}
+}
+
+struct wsbg_watcher *wsbg_watcher_create(struct wl_list *images) {
+	struct wsbg_watcher *watcher = calloc(1, sizeof *watcher);
+	if (!watcher || !(watcher->watches = calloc(
+			wl_list_length(images), sizeof *watcher->watches))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		free(watcher);
+		return NULL;
+	}
+	watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watcher->fd == -1) {
+		wsbg_log_errno(LOG_ERROR, "Unable to initialize inotify");
+		goto error;
+	}
+
+	struct wsbg_image *image;
+	wl_list_for_each(image, images, link) {
+		// Slideshows pick up changed files at their next transition
+		if (image->is_directory) {
+			continue;
+		}
+		struct watch *watch = &watcher->watches[watcher->count];
+		const char *slash = strrchr(image->path, '/');
+		watch->image = image;
+		watch->dir = !slash ? strdup(".") : slash == image->path ?
+			strdup("/") : strndup(image->path, slash - image->path);
+		if (!watch->dir) {
+			wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+			goto error;
+		}
+		watch->name = slash ? slash + 1 : image->path;
+		++watcher->count;
+
+		// Watching the same directory again gives the same descriptor
+		watch->dir_wd = inotify_add_watch(watcher->fd, watch->dir, DIR_EVENTS);
+		if (watch->dir_wd == -1) {
+			wsbg_log_errno(LOG_DEBUG, "Unable to watch %s", watch->dir);
+		}
+		watch_file(watcher, watch);
+	}
+	return watcher;
+
+error:
+	wsbg_watcher_destroy(watcher);
+	return NULL;
+}
+
+void wsbg_watcher_destroy(struct wsbg_watcher *watcher) {
+	if (!watcher) {
+		return;
+	}
+	for (size_t i = 0; i < watcher->count; ++i) {
+		free(watcher->watches[i].dir);
+	}
+	free(watcher->watches);
+	if (watcher->fd != -1) {
+		close(watcher->fd);
+	}
+	free(watcher);
+}
+
+int wsbg_watcher_get_fd(struct wsbg_watcher *watcher) {
+	return watcher->fd;
+}
+
+static void handle_event(struct wsbg_watcher *watcher,
+		const struct inotify_event *event) {
+	for (size_t i = 0; i < watcher->count; ++i) {
+		struct watch *watch = &watcher->watches[i];
+		if (event->mask & IN_Q_OVERFLOW) {
+			// Events were lost, so any file may have changed
+			watch->changed = true;
+		} else if (event->wd == watch->file_wd) {
+			if (event->mask & IN_IGNORED) {
+				watch->file_wd = -1;
+			} else {
+				watch->changed = true;
+			}
+		} else if (event->wd == watch->dir_wd) {
+			if (event->mask & IN_IGNORED) {
+				watch->dir_wd = -1;
+			} else if (event->len && strcmp(event->name, watch->name) == 0) {
+				watch->changed = true;
+			}
+		}
+	}
+}
+
+void wsbg_watcher_dispatch(struct wsbg_watcher *watcher,
+		wsbg_watch_func_t func, void *data) {
+	_Alignas(struct inotify_event) char buffer[4096];
+	ssize_t size;
+	while ((size = read(watcher->fd, buffer, sizeof buffer)) > 0) {
+		const char *p = buffer;
+		while (p < buffer + size) {
+			const struct inotify_event *event = (const void *)p;
+			handle_event(watcher, event);
+			p += sizeof *event + event->len;
+		}
+	}
+	if (size == -1 && errno != EAGAIN) {
+		wsbg_log_errno(LOG_ERROR, "Unable to read inotify events");
+	}
+
+	// Several events of the same change are reported once
+	for (size_t i = 0; i < watcher->count; ++i) {
+		struct watch *watch = &watcher->watches[i];
+		if (!watch->changed) {
+			continue;
+		}
+		watch->changed = false;
+		// A file moved over the old one is watched from now on
+		watch_file(watcher, watch);
+		func(watch->image, data);
+	}
+}
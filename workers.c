@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "log.h"
+#include "workers.h"
+
+struct wsbg_workers {
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	pthread_t *threads;
+	unsigned thread_count;
+
+	// Current loop, protected by `lock`
+	wsbg_workers_func_t func;
+	void *data;
+	unsigned next, count, running;
+	unsigned generation;
+	bool exit;
+};
+
+unsigned wsbg_workers_default_count(void) {
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == 0) {
+		return CPU_COUNT(&set);
+	}
+#endif
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count < 1 ? 1 : count;
+}
+
+/**
+ * Runs iterations of the current loop until there are none left.
+ * Must be called with `lock` held.
+ */
+static void run_iterations(struct wsbg_workers *workers) {
+	while (workers->next < workers->count) {
+		unsigned index = workers->next++;
+		++workers->running;
+		pthread_mutex_unlock(&workers->lock);
+
+		workers->func(workers->data, index);
+
+		pthread_mutex_lock(&workers->lock);
+		if (--workers->running == 0 && workers->next == workers->count) {
+			pthread_cond_signal(&workers->done);
+		}
+	}
+}
+
+static void *worker_main(void *data) {
+	struct wsbg_workers *workers = data;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&workers->lock);
+	while (true) {
+		while (!workers->exit && generation == workers->generation) {
+			pthread_cond_wait(&workers->start, &workers->lock);
+		}
+		if (workers->exit) {
+			break;
+		}
+		generation = workers->generation;
+		run_iterations(workers);
+	}
+	pthread_mutex_unlock(&workers->lock);
+	return NULL;
+}
+
+struct wsbg_workers *wsbg_workers_create(unsigned count) {
+	struct wsbg_workers *workers = calloc(1, sizeof *workers);
+	if (!workers) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		return NULL;
+	}
+	pthread_mutex_init(&workers->lock, NULL);
+	pthread_cond_init(&workers->start, NULL);
+	pthread_cond_init(&workers->done, NULL);
+
+	if (count > 1 && !(workers->threads =
+			calloc(count - 1, sizeof *workers->threads))) {
+		wsbg_log_errno(LOG_ERROR, "Memory allocation failed");
+		count = 1;
+	}
+	for (unsigned i = 0; i + 1 < count; ++i) {
+		int err = pthread_create(&workers->threads[i], NULL,
+				worker_main, workers);
+		if (err) {
+			errno = err;
+			wsbg_log_errno(LOG_ERROR, "Unable to start worker thread");
+			break;
+		}
+		++workers->thread_count;
+	}
+	return workers;
+}
+
+void wsbg_workers_destroy(struct wsbg_workers *workers) {
+	if (!workers) {
+		return;
+	}
+	pthread_mutex_lock(&workers->lock);
+	workers->exit = true;
+	pthread_cond_broadcast(&workers->start);
+	pthread_mutex_unlock(&workers->lock);
+
+	for (unsigned i = 0; i < workers->thread_count; ++i) {
+		pthread_join(workers->threads[i], NULL);
+	}
+	pthread_cond_destroy(&workers->done);
+	pthread_cond_destroy(&workers->start);
+	pthread_mutex_destroy(&workers->lock);
+	free(workers->threads);
+	free(workers);
+}
+
+unsigned wsbg_workers_count(struct wsbg_workers *workers) {
+	return workers ? workers->thread_count + 1 : 1;
+}
+
+void wsbg_workers_run(struct wsbg_workers *workers,
+		wsbg_workers_func_t func, void *data, unsigned count) {
+	if (!workers || workers->thread_count == 0 || count < 2) {
+		for (unsigned i = 0; i < count; ++i) {
+			func(data, i);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&workers->lock);
+	workers->func = func;
+	workers->data = data;
+	workers->next = 0;
+	workers->count = count;
+	++workers->generation;
+	pthread_cond_broadcast(&workers->start);
+
+	run_iterations(workers);
+	while (workers->running != 0) {
+		pthread_cond_wait(&workers->done, &workers->lock);
+	}
+	pthread_mutex_unlock(&workers->lock);
+}